@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* *** Constants *****************************************************/
+#define DEFAULT_INPUT_SIZE (8 * 1024 * 1024)
+#define READ_BUFFER_SIZE (256 * 1024)
+#define ESCAPE_CHAR '\033'
+#define MAX_COLOR_START_LENGTH (sizeof("<span") - 1)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+/* *** Types *********************************************************/
+/* Synthetic inputs. */
+typedef void(generate_f)(char *data, size_t size, uint32_t *seed);
+
+typedef struct input_s {
+    const char *name;
+    generate_f *generate;
+    char path[64];
+    size_t size;
+    size_t chars;
+    size_t escapes;
+} input_t;
+
+/* Output modes. */
+typedef struct output_mode_s {
+    const char *name;
+    const char *option;
+    const char *color_start; /* What each color escape in the output starts with. */
+    bool passes_escapes;     /* Whether the escape sequences of the input are in the output. */
+} output_mode_t;
+
+/* What a single run of queercat produced. */
+typedef struct result_s {
+    double seconds;
+    size_t output_bytes;
+    size_t output_escapes;
+} result_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Generators */
+static uint32_t next_random(uint32_t *seed);
+static size_t append(char *data, size_t position, size_t size, const char *text);
+generate_f generate_ascii_log;
+generate_f generate_cjk;
+generate_f generate_escapes;
+generate_f generate_long_lines;
+
+/* Running */
+static void write_input(input_t *input, size_t size);
+static bool flag_exists(const char *queercat, int flag);
+static bool run_queercat(const char *queercat, const input_t *input, int flag, const output_mode_t *mode, bool quiet, result_t *result);
+
+
+/* *** Inputs ********************************************************/
+input_t inputs[] = {
+    { .name = "ascii-log", .generate = generate_ascii_log },
+    { .name = "cjk", .generate = generate_cjk },
+    { .name = "escapes", .generate = generate_escapes },
+    { .name = "long-lines", .generate = generate_long_lines },
+};
+
+const output_mode_t modes[] = {
+    { .name = "ansi", .option = NULL, .color_start = "\033", .passes_escapes = true },
+    { .name = "24bit", .option = "--24bit", .color_start = "\033", .passes_escapes = true },
+    { .name = "html", .option = "--html", .color_start = "<span", .passes_escapes = false },
+};
+
+const int INPUT_COUNT = sizeof(inputs)/sizeof(inputs[0]);
+const int MODE_COUNT = sizeof(modes)/sizeof(modes[0]);
+
+
+/* *** Functions *****************************************************/
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Appends text if it fits, otherwise pads the rest of data with newlines. */
+static size_t append(char *data, size_t position, size_t size, const char *text)
+{
+    size_t length = strlen(text);
+
+    if (position + length > size) {
+        memset(data + position, '\n', size - position);
+        return size;
+    }
+
+    memcpy(data + position, text, length);
+    return position + length;
+}
+
+void generate_ascii_log(char *data, size_t size, uint32_t *seed)
+{
+    static const char *words[] = {
+        "[ 42%]", "Building", "C", "object", "CMakeFiles/queercat.dir/main.c.o", "warning:",
+        "unused", "variable", "'i'", "[-Wunused-variable]", "/usr/include/stdio.h:42:", "ok", "PASSED"
+    };
+    size_t position = 0;
+
+    while (position < size) {
+        int words_count = 4 + next_random(seed) % 12;
+        for (int i = 0; i < words_count && position < size; i++) {
+            position = append(data, position, size, words[next_random(seed) % (sizeof(words) / sizeof(words[0]))]);
+            position = append(data, position, size, i + 1 < words_count ? " " : "\n");
+        }
+    }
+}
+
+void generate_cjk(char *data, size_t size, uint32_t *seed)
+{
+    static const char *words[] = { "日本語", "中文字符", "한국어", "テスト", "ログ", "。", "、", "abc" };
+    size_t position = 0;
+
+    while (position < size) {
+        int words_count = 8 + next_random(seed) % 24;
+        for (int i = 0; i < words_count && position < size; i++)
+            position = append(data, position, size, words[next_random(seed) % (sizeof(words) / sizeof(words[0]))]);
+        position = append(data, position, size, "\n");
+    }
+}
+
+void generate_escapes(char *data, size_t size, uint32_t *seed)
+{
+    static const char *words[] = {
+        "\033[1m", "\033[0m", "\033[31m", "\033[32;1m", "\033[38;5;208m", "\033[K",
+        "error", "ok", "test_parse", "...", "(0.01s)"
+    };
+    size_t position = 0;
+
+    while (position < size) {
+        int words_count = 4 + next_random(seed) % 12;
+        for (int i = 0; i < words_count && position < size; i++) {
+            position = append(data, position, size, words[next_random(seed) % (sizeof(words) / sizeof(words[0]))]);
+            position = append(data, position, size, i + 1 < words_count ? " " : "\n");
+        }
+    }
+}
+
+void generate_long_lines(char *data, size_t size, uint32_t *seed)
+{
+    size_t position = 0;
+
+    while (position < size) {
+        size_t line_length = 64 * 1024 + next_random(seed) % (64 * 1024);
+        for (size_t i = 0; i < line_length && position < size; i++)
+            data[position++] = (i % 9 == 8) ? ' ' : 'a' + next_random(seed) % 26;
+        if (position < size)
+            data[position++] = '\n';
+    }
+}
+
+static void write_input(input_t *input, size_t size)
+{
+    char *data = malloc(size);
+    uint32_t seed = 1;
+
+    if (data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    input->generate(data, size, &seed);
+    input->size = size;
+    input->chars = 0;
+    input->escapes = 0;
+    for (size_t i = 0; i < size; i++) {
+        input->chars += ((data[i] & 0xc0) != 0x80);
+        input->escapes += (data[i] == ESCAPE_CHAR);
+    }
+
+    snprintf(input->path, sizeof(input->path), "/tmp/queercat-bench-%s-XXXXXX", input->name);
+    int fd = mkstemp(input->path);
+    if (fd < 0 || write(fd, data, size) != (ssize_t)size || close(fd)) {
+        perror(input->path);
+        exit(1);
+    }
+
+    free(data);
+}
+
+/* Runs queercat on input and counts its output. Returns false if it failed. */
+static bool run_queercat(const char *queercat, const input_t *input, int flag, const output_mode_t *mode, bool quiet, result_t *result)
+{
+    static char buffer[MAX_COLOR_START_LENGTH - 1 + READ_BUFFER_SIZE];
+    size_t start_length = strlen(mode->color_start);
+    size_t carried = 0;
+    char flag_string[16];
+    struct timespec start, end;
+    int pipe_fds[2];
+    int status;
+
+    snprintf(flag_string, sizeof(flag_string), "%d", flag);
+
+    if (pipe(pipe_fds)) {
+        perror("pipe");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        if (quiet)
+            dup2(null_fd, STDERR_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+
+        /* A fixed offset keeps runs comparable. */
+        if (mode->option != NULL)
+            execl(queercat, queercat, "-F", "-o", "0", "-f", flag_string, mode->option, input->path, (char *)NULL);
+        else
+            execl(queercat, queercat, "-F", "-o", "0", "-f", flag_string, input->path, (char *)NULL);
+        _exit(127);
+    }
+
+    close(pipe_fds[1]);
+
+    result->output_bytes = 0;
+    result->output_escapes = 0;
+    for (;;) {
+        ssize_t bytes_read = read(pipe_fds[0], buffer + carried, READ_BUFFER_SIZE);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            break;
+
+        result->output_bytes += bytes_read;
+        const char *end = buffer + carried + bytes_read;
+        for (const char *escape = buffer; (escape = memmem(escape, end - escape, mode->color_start, start_length)) != NULL; escape += start_length)
+            result->output_escapes++;
+
+        /* Keep what may be the start of an escape cut off by the read. */
+        carried = MIN(start_length - 1, (size_t)(end - buffer));
+        memmove(buffer, end - carried, carried);
+    }
+    close(pipe_fds[0]);
+
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool flag_exists(const char *queercat, int flag)
+{
+    input_t empty = { .path = "/dev/null" };
+    result_t result;
+
+    return run_queercat(queercat, &empty, flag, &modes[0], true, &result);
+}
+
+int main(int argc, char** argv)
+{
+    size_t size = DEFAULT_INPUT_SIZE;
+    int repeats = 3;
+    int i;
+
+    /* Handle options. */
+    for (i = 1; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) {
+            size = strtoul(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--repeats")) {
+            repeats = atoi(argv[++i]);
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc - 1 || size == 0 || repeats < 1) {
+        fprintf(stderr, "Usage: queercat-bench [-s size_mb] [-r repeats] path/to/queercat\n");
+        return 1;
+    }
+    const char *queercat = argv[i];
+
+    /* Measure the UTF-8 path whatever the caller's locale is. */
+    setenv("LANG", "C.UTF-8", 1);
+
+    for (int input = 0; input < INPUT_COUNT; input++)
+        write_input(&inputs[input], size);
+
+    printf("%-12s %5s %-6s %10s %10s %12s\n", "input", "flag", "mode", "MB/s", "out/in", "escapes/char");
+
+    int failures = 0;
+    for (int input = 0; input < INPUT_COUNT; input++) {
+        for (int flag = 0; flag_exists(queercat, flag); flag++) {
+            for (int mode = 0; mode < MODE_COUNT; mode++) {
+                result_t result, best = { 0 };
+                size_t passed_escapes = modes[mode].passes_escapes ? inputs[input].escapes : 0;
+
+                /* Keep the fastest of the repeats. */
+                for (int repeat = 0; repeat < repeats; repeat++) {
+                    if (!run_queercat(queercat, &inputs[input], flag, &modes[mode], false, &result)) {
+                        failures++;
+                        break;
+                    }
+                    if (repeat == 0 || result.seconds < best.seconds)
+                        best = result;
+                }
+
+                printf("%-12s %5d %-6s %10.1f %10.2f %12.3f\n",
+                        inputs[input].name, flag, modes[mode].name,
+                        inputs[input].size / best.seconds / (1024 * 1024),
+                        (double)best.output_bytes / inputs[input].size,
+                        ((double)best.output_escapes - passed_escapes) / inputs[input].chars);
+            }
+        }
+    }
+
+    for (int input = 0; input < INPUT_COUNT; input++)
+        unlink(inputs[input].path);
+
+    return failures ? 1 : 0;
+}
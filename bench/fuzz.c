@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "queercat.h"
+
+
+/* *** Constants *****************************************************/
+#define DEFAULT_ITERATIONS (10000)
+#define MAX_INPUT_SIZE (64 * 1024)
+#define LARGE_INPUT_SIZE (3 * 1024 * 1024) /* Enough for queercat_colorize_parallel to split. */
+#define LARGE_INPUT_INTERVAL (100)
+#define MAX_PARALLEL_JOBS (4)
+#define PLAIN_INPUT_INTERVAL (3)
+#define MAX_SGR_PARAMETERS (16)
+#define RESET_ESCAPE "\033[0m"
+#define SPAN_OPEN "<span style=color:#"
+#define SPAN_CLOSE "</span>"
+
+/* Colors of the terminal model: the default one, palette indexes, and 24-bit
+ * colors as RGB_COLOR | 0xrrggbb. */
+#define DEFAULT_COLOR (-1)
+#define RGB_COLOR (1 << 24)
+
+/* How far apart in each channel a 24-bit color may be from the original's, which
+ * the colorizer takes from a table of QUEERCAT_COLOR_TABLE_SIZE samples. Those are at most
+ * a level off. */
+#define MAX_COLOR_DISTANCE (2)
+
+
+/* *** Types *********************************************************/
+/* A growing output. */
+typedef struct buffer_s {
+    char *data;
+    size_t length;
+    size_t capacity;
+} buffer_t;
+
+/* Where the original colorizer was in an escape sequence. */
+typedef enum original_escape_state_e {
+    ORIGINAL_ESCAPE_STATE_OUT = 0,
+    ORIGINAL_ESCAPE_STATE_IN,
+    ORIGINAL_ESCAPE_STATE_LAST
+} original_escape_state_t;
+
+/* A character drawn on the terminal and its color. For the original colorizer,
+ * alternative is a color the character may as well be drawn in: that of the next
+ * ANSI band when its position is right on the edge. */
+typedef struct cell_s {
+    wchar_t character;
+    int32_t color;
+    int32_t alternative;
+} cell_t;
+
+/* What one way of colorizing an input produced. */
+typedef struct result_s {
+    buffer_t output;
+    int status;
+    queercat_stats_t stats;
+} result_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Generators */
+static uint32_t next_random(uint32_t *seed);
+static size_t generate_input(uint8_t *data, size_t size, bool valid, bool plain, uint32_t *seed);
+static void pick_options(uint32_t *seed, queercat_options_t *options);
+
+/* Colorizing */
+static void buffer_append(void *cookie, const void *data, size_t length);
+static void colorize_reference(const queercat_options_t *options, const uint8_t *input, size_t length, result_t *result);
+static void colorize_chunked(const queercat_options_t *options, const uint8_t *input, size_t length, uint32_t seed, result_t *result);
+static void colorize_parallel(const queercat_options_t *options, const uint8_t *input, size_t length, uint32_t seed, result_t *result);
+
+/* The original colorizer */
+static void original_find_escape_sequences(wint_t current_char, original_escape_state_t *state);
+static void original_mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, queercat_color_t *output_color);
+static void original_get_color_rainbow(const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color);
+static void original_get_color_stripes(const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color);
+static void original_print_color(const queercat_options_t *options, int char_index, int line_index, buffer_t *output, int32_t *alternative);
+static void colorize_original(const queercat_options_t *options, const uint8_t *input, size_t length, buffer_t *output, buffer_t *alternatives);
+
+/* Terminal model */
+static bool plain_input(const uint8_t *input, size_t length);
+static bool starts_with(const char *data, size_t length, const char *prefix);
+static void apply_sgr(const char *parameters, size_t length, int32_t *color);
+static size_t read_html_entity(const char *data, size_t length, wchar_t *character);
+static void read_cells(const buffer_t *output, bool html, buffer_t *cells);
+static bool same_color(const cell_t *original, const cell_t *cell);
+static void format_color(int32_t color, char *text, size_t size);
+
+/* Checking */
+static bool same_result(const result_t *reference, const result_t *result);
+static void print_options(const queercat_options_t *options);
+static void report_mismatch(const char *path_name, const queercat_options_t *options, const result_t *reference, const result_t *result);
+static bool same_cells(const char *path_name, const queercat_options_t *options, const buffer_t *original_cells, const result_t *result);
+static bool check_input(const uint8_t *input, size_t length, uint32_t seed);
+
+
+/* *** Inputs ********************************************************/
+/* Pieces the inputs are made of, weighted toward what the shortcuts of the
+ * colorizer treat specially: printable ASCII runs, escape sequences, wide and
+ * zero-width characters, HTML markup, and invalid or cut short sequences. */
+const char *pieces[] = {
+    "a", "hello world ", "0123456789abcdef", "\t", "\n", "\r\n", " ", "<b>", "a && b", "->",
+    "\033[1m", "\033[0m", "\033[38;5;208m", "\033[38;2;1;2;3m", "\033[K", "\033[2J", "\033[?25l",
+    "\033]0;title\007", "\033]8;;http://x\033\\", "\033P1$r\033\\", "\033_apc\033\\", "\033^pm\033\\",
+    "\033X sos \033\\", "\033(B", "\033c", "\033", "\033[", "\033[12", "\033]2;", "\033[3\n1m",
+    "\030", "\032", "\007", "\177", "\001",
+    "é", "ß", "日本語", "中文", "한국어", "テスト", "é", "​", "\U0001F600", "\U0001F3F3️‍\U0001F308",
+    " ", " ", "\xc2\x85", "\xc2\x9b" "1m", "\xc2\x9d" "0;x" "\xc2\x9c",
+    "\xf8\x88\x80\x80\x80", "\xfc\x84\x80\x80\x80\x80",
+};
+const int PIECE_COUNT = sizeof(pieces)/sizeof(pieces[0]);
+
+const char *color_type_names[QUEERCAT_COLOR_TYPE_COUNT] = {
+    [QUEERCAT_COLOR_TYPE_ANSII] = "ansi",
+    [QUEERCAT_COLOR_TYPE_24_BIT] = "24-bit",
+    [QUEERCAT_COLOR_TYPE_HTML] = "html"
+};
+
+/* Pieces the original colorizer handles the way the colorizer does: no C1
+ * controls, and only complete control sequences, ending in a letter, with no
+ * controls inside. */
+const char *plain_pieces[] = {
+    "a", "hello world ", "0123456789abcdef", "\t", "\n", "\r\n", " ", "<b>", "a && b", "->",
+    "\033[1m", "\033[0m", "\033[38;5;208m", "\033[38;2;1;2;3m", "\033[K", "\033[2J", "\033[?25l",
+    "\030", "\032", "\007", "\177", "\001",
+    "é", "ß", "日本語", "中文", "한국어", "テスト", "é", "​", "\U0001F600", "\U0001F3F3️‍\U0001F308",
+    " ", " ",
+};
+const int PLAIN_PIECE_COUNT = sizeof(plain_pieces)/sizeof(plain_pieces[0]);
+
+/* Bytes that are never valid where they appear. */
+const char *invalid_pieces[] = {
+    "\x80", "\xc0\xaf", "\xc3", "\xe3\x81", "\xed\xa0\x80", "\xff", "\xfe", "\xf0\x82\x82\xac",
+};
+const int INVALID_PIECE_COUNT = sizeof(invalid_pieces)/sizeof(invalid_pieces[0]);
+
+
+/* *** Functions *****************************************************/
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Fills data with up to size bytes of pieces, or of plain pieces only. Unless
+ * valid or plain, an invalid one comes up now and then, rarely since colorizing
+ * stops there. Returns the length. */
+static size_t generate_input(uint8_t *data, size_t size, bool valid, bool plain, uint32_t *seed)
+{
+    size_t target = next_random(seed) % size;
+    size_t position = 0;
+
+    while (position < target) {
+        const char *piece;
+
+        if (plain)
+            piece = plain_pieces[next_random(seed) % PLAIN_PIECE_COUNT];
+        else if (!valid && next_random(seed) % 512 == 0)
+            piece = invalid_pieces[next_random(seed) % INVALID_PIECE_COUNT];
+        else
+            piece = pieces[next_random(seed) % PIECE_COUNT];
+
+        size_t length = strlen(piece);
+        if (position + length > size)
+            break;
+
+        /* Long lines cross the end of the column row. */
+        int repeats = (next_random(seed) % 16 == 0) ? 1 + next_random(seed) % 256 : 1;
+        for (int i = 0; i < repeats && position + length <= size; i++) {
+            memcpy(data + position, piece, length);
+            position += length;
+        }
+    }
+
+    return position;
+}
+
+static void pick_options(uint32_t *seed, queercat_options_t *options)
+{
+    static const double frequencies[] = { 0.23, 0.1, 0, 1, 0.05, 3.7, -0.4 };
+    const int frequencies_count = sizeof(frequencies)/sizeof(frequencies[0]);
+
+    memset(options, 0, sizeof(*options));
+    options->pattern = queercat_pattern(next_random(seed) % queercat_pattern_count());
+    options->color_type = next_random(seed) % QUEERCAT_COLOR_TYPE_COUNT;
+    options->freq_h = frequencies[next_random(seed) % frequencies_count];
+    options->freq_v = frequencies[next_random(seed) % frequencies_count];
+    options->offx = (next_random(seed) % 1000) / 1000.0;
+    options->rand_offset = (next_random(seed) % 2) ? next_random(seed) : 0;
+    options->print_colors = next_random(seed) % 8 != 0;
+    options->max_colors = (next_random(seed) % 4 == 0) ? 1 + next_random(seed) % 8 : 0;
+    options->min_run = (next_random(seed) % 4 == 0) ? 1 + next_random(seed) % 6 : 0;
+}
+
+/* A queercat_write_f. Exits if out of memory. */
+static void buffer_append(void *cookie, const void *data, size_t length)
+{
+    buffer_t *buffer = cookie;
+
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = 2 * buffer->capacity + length;
+        buffer->data = realloc(buffer->data, capacity);
+        if (buffer->data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/* Colorizes input a character at a time, decoded by the C library the way the
+ * original fgetwc loop did. */
+static void colorize_reference(const queercat_options_t *options, const uint8_t *input, size_t length, result_t *result)
+{
+    char output[QUEERCAT_MIN_OUTPUT_SIZE];
+    size_t written;
+    mbstate_t state;
+    size_t position = 0;
+
+    queercat_t *queercat = queercat_create(options);
+    if (queercat == NULL) {
+        perror("queercat_create");
+        exit(1);
+    }
+
+    memset(&state, 0, sizeof(state));
+    result->status = 0;
+    while (position < length) {
+        wchar_t current_char;
+        size_t sequence_length = mbrtowc(&current_char, (const char *)input + position, length - position, &state);
+
+        /* An incomplete character at the end is dropped. */
+        if (sequence_length == (size_t)-2)
+            break;
+
+        if (sequence_length == (size_t)-1) {
+            result->status = -1;
+            break;
+        }
+
+        /* The null character. */
+        if (sequence_length == 0)
+            sequence_length = 1;
+
+        queercat_colorize_char(queercat, current_char, (const char *)input + position, sequence_length,
+                output, sizeof(output), &written);
+        buffer_append(&result->output, output, written);
+        position += sequence_length;
+    }
+
+    queercat_end_input(queercat, output, sizeof(output), &written);
+    buffer_append(&result->output, output, written);
+
+    queercat_get_stats(queercat, &result->stats);
+    queercat_destroy(queercat);
+}
+
+/* Colorizes input with queercat_colorize, in pieces of random sizes into output
+ * buffers of random sizes, so characters and escape sequences get split. */
+static void colorize_chunked(const queercat_options_t *options, const uint8_t *input, size_t length, uint32_t seed, result_t *result)
+{
+    size_t output_size = QUEERCAT_MIN_OUTPUT_SIZE + next_random(&seed) % 4096;
+    char *output = malloc(output_size);
+    size_t position = 0;
+    size_t written;
+
+    queercat_t *queercat = queercat_create(options);
+    if (queercat == NULL || output == NULL) {
+        perror("queercat_create");
+        exit(1);
+    }
+
+    result->status = 0;
+    while (position < length && result->status == 0) {
+        size_t end = position + 1 + next_random(&seed) % 512;
+        if (end > length || next_random(&seed) % 4 == 0)
+            end = length;
+
+        /* Pass the rest of the piece again for as long as the output fills up. */
+        while (position < end) {
+            size_t consumed;
+
+            result->status = queercat_colorize(queercat, input + position, end - position, &consumed,
+                    output, output_size, &written);
+            buffer_append(&result->output, output, written);
+            position += consumed;
+            if (result->status < 0)
+                break;
+        }
+    }
+
+    queercat_end_input(queercat, output, output_size, &written);
+    buffer_append(&result->output, output, written);
+
+    queercat_get_stats(queercat, &result->stats);
+    queercat_destroy(queercat);
+    free(output);
+}
+
+/* Colorizes input with queercat_colorize_parallel, on a colorizer copied from
+ * another one the way the server does. */
+static void colorize_parallel(const queercat_options_t *options, const uint8_t *input, size_t length, uint32_t seed, result_t *result)
+{
+    char output[QUEERCAT_MIN_OUTPUT_SIZE];
+    size_t written;
+
+    queercat_t *base = queercat_create(options);
+    queercat_t *queercat = (base != NULL) ? queercat_copy(base, options) : NULL;
+    if (queercat == NULL) {
+        perror("queercat_create");
+        exit(1);
+    }
+
+    int jobs = 1 + next_random(&seed) % MAX_PARALLEL_JOBS;
+    result->status = queercat_colorize_parallel(queercat, input, length, jobs, buffer_append, &result->output);
+
+    queercat_end_input(queercat, output, sizeof(output), &written);
+    buffer_append(&result->output, output, written);
+
+    queercat_get_stats(queercat, &result->stats);
+    queercat_destroy(queercat);
+    queercat_destroy(base);
+}
+
+/* The original colorizer, queercat's main loop before the colorizer was written,
+ * kept apart from it so that it checks the colorizer rather than sharing its
+ * mistakes. It differs from the original only where that had undefined or
+ * imprecise results: wcwidth's -1 for controls counts as 0, ANSI bands are
+ * floored rather than truncated toward 0 and their codes picked with a
+ * non-negative modulo, theta is worked out in double, which keeps the column
+ * past a few thousand, and every color is stated, even when the band is -1. */
+static void original_find_escape_sequences(wint_t current_char, original_escape_state_t *state)
+{
+    if (current_char == '\033') {
+        *state = ORIGINAL_ESCAPE_STATE_IN;
+    } else if (*state == ORIGINAL_ESCAPE_STATE_IN) {
+        bool letter = ('a' <= current_char && current_char <= 'z') || ('A' <= current_char && current_char <= 'Z');
+        *state = letter ? ORIGINAL_ESCAPE_STATE_LAST : ORIGINAL_ESCAPE_STATE_IN;
+    } else {
+        *state = ORIGINAL_ESCAPE_STATE_OUT;
+    }
+}
+
+static void original_mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, queercat_color_t *output_color)
+{
+    uint8_t red_1   = (color1 & 0xff0000) >> 16;
+    uint8_t green_1 = (color1 & 0x00ff00) >>  8;
+    uint8_t blue_1  = (color1 & 0x0000ff) >>  0;
+
+    uint8_t red_2   = (color2 & 0xff0000) >> 16;
+    uint8_t green_2 = (color2 & 0x00ff00) >>  8;
+    uint8_t blue_2  = (color2 & 0x0000ff) >>  0;
+
+    balance = pow(balance, factor);
+
+    output_color->red = lrintf(red_1 * balance + red_2 * (1.0f - balance));
+    output_color->green = lrintf(green_1 * balance + green_2 * (1.0f - balance));
+    output_color->blue = lrintf(blue_1 * balance + blue_2 * (1.0f - balance));
+}
+
+static void original_get_color_rainbow(const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color)
+{
+    (void)color_pattern;
+
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Generate the color. */
+    color->red   = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 0            ))) * 255.0f);
+    color->green = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 2 * M_PI / 3 ))) * 255.0f);
+    color->blue  = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 4 * M_PI / 3 ))) * 255.0f);
+}
+
+static void original_get_color_stripes(const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color)
+{
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Find the stripe based on theta and generate the color. */
+    for (int i = 0; i < color_pattern->stripes_count; i++) {
+        float stripe_size = (2.0f * M_PI) / color_pattern->stripes_count;
+        float min_theta = i * stripe_size;
+        float max_theta = (i + 1) * stripe_size;
+
+        if (min_theta <= theta && max_theta > theta) {
+            float balance = 1 - ((theta - min_theta) / stripe_size);
+            original_mix_colors(
+                    color_pattern->stripes_colors[i],
+                    color_pattern->stripes_colors[(i + 1) % color_pattern->stripes_count],
+                    balance,
+                    color_pattern->factor,
+                    color);
+            return;
+        }
+    }
+}
+
+/* Writes the color for a position, and sets alternative to a color the position
+ * may as well have, given how precisely the colorizer works the band out. */
+static void original_print_color(const queercat_options_t *options, int char_index, int line_index, buffer_t *output, int32_t *alternative)
+{
+    const queercat_pattern_t *pattern = options->pattern;
+    char escape[sizeof("\033[38;2;255;255;255m")];
+    queercat_color_t color = { 0 };
+    double theta;
+
+    switch (options->color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            theta = char_index * options->freq_h / 5.0 + line_index * options->freq_v
+                + (options->offx + 2.0 * options->rand_offset / RAND_MAX) * M_PI;
+            theta -= floor(theta / (2.0 * M_PI)) * (2.0 * M_PI);
+
+            if (pattern->get_color == queercat_get_color_rainbow)
+                original_get_color_rainbow(&pattern->color_pattern, theta, &color);
+            else
+                original_get_color_stripes(&pattern->color_pattern, theta, &color);
+            buffer_append(output, escape, snprintf(escape, sizeof(escape), "\033[38;2;%d;%d;%dm", color.red, color.green, color.blue));
+            *alternative = RGB_COLOR | color.red << 16 | color.green << 8 | color.blue;
+            break;
+
+        case QUEERCAT_COLOR_TYPE_ANSII: {
+            const queercat_ansii_pattern_t *ansii_pattern = &pattern->ansii_pattern;
+            long long codes_count = ansii_pattern->codes_count;
+            long long offset = (long long)(options->offx * codes_count) + options->rand_offset;
+            double position = char_index * options->freq_h + line_index * options->freq_v;
+
+            /* The colorizer keeps the position in 32-bit fractions of a period. */
+            double epsilon = 1e-6 + (char_index + 1.0) * codes_count / 2147483648.0;
+            long long band = floor(position);
+            long long other_band = (floor(position - epsilon) != band) ? band - 1 : (long long)floor(position + epsilon);
+
+            unsigned char code = ansii_pattern->ansii_codes[((offset + band) % codes_count + codes_count) % codes_count];
+            buffer_append(output, escape, snprintf(escape, sizeof(escape), "\033[38;5;%hhum", code));
+            *alternative = ansii_pattern->ansii_codes[((offset + other_band) % codes_count + codes_count) % codes_count];
+            break;
+        }
+
+        default:
+            exit(1);
+    }
+}
+
+/* Colorizes valid input a character at a time the way the original colorizer
+ * did, and adds the alternative color of each character drawn to alternatives. */
+static void colorize_original(const queercat_options_t *options, const uint8_t *input, size_t length, buffer_t *output, buffer_t *alternatives)
+{
+    original_escape_state_t escape_state = ORIGINAL_ESCAPE_STATE_OUT;
+    int char_index = 0;
+    int line_index = 0;
+    int32_t alternative;
+    mbstate_t state;
+    size_t position = 0;
+
+    memset(&state, 0, sizeof(state));
+    while (position < length) {
+        wchar_t current_char;
+        size_t sequence_length = mbrtowc(&current_char, (const char *)input + position, length - position, &state);
+
+        /* The null character. */
+        if (sequence_length == 0)
+            sequence_length = 1;
+
+        /* If set to print colors, handle the colors. */
+        if (options->print_colors) {
+
+            /* Skip escape sequences. */
+            original_find_escape_sequences(current_char, &escape_state);
+            if (escape_state == ORIGINAL_ESCAPE_STATE_OUT) {
+
+                /* Handle newlines. */
+                if (current_char == '\n') {
+                    line_index++;
+                    char_index = 0;
+                } else {
+                    int width = wcwidth(current_char);
+                    char_index += (width > 0) ? width : 0;
+                    original_print_color(options, char_index, line_index, output, &alternative);
+                    if (width > 0)
+                        buffer_append(alternatives, &alternative, sizeof(alternative));
+                }
+            }
+        }
+
+        /* Print the char. */
+        buffer_append(output, input + position, sequence_length);
+        position += sequence_length;
+
+        if (escape_state == ORIGINAL_ESCAPE_STATE_LAST)  /* implies "print_colors" */
+            original_print_color(options, char_index, line_index, output, &alternative);
+    }
+
+    if (options->print_colors)
+        buffer_append(output, RESET_ESCAPE, strlen(RESET_ESCAPE));
+}
+
+/* Returns whether the original colorizer handles input the way the colorizer
+ * does: it must be valid, without C1 controls, and its escape sequences must all
+ * be complete control sequences ending in a letter. */
+static bool plain_input(const uint8_t *input, size_t length)
+{
+    mbstate_t state;
+    size_t position = 0;
+
+    memset(&state, 0, sizeof(state));
+    while (position < length) {
+        wchar_t current_char;
+        size_t sequence_length = mbrtowc(&current_char, (const char *)input + position, length - position, &state);
+
+        if (sequence_length == (size_t)-1 || sequence_length == (size_t)-2 || (0x80 <= current_char && current_char < 0xa0))
+            return false;
+
+        if (current_char != '\033') {
+            position += sequence_length ? sequence_length : 1;
+            continue;
+        }
+
+        /* "ESC [", parameter bytes, intermediate bytes, and a letter. */
+        position++;
+        if (position == length || input[position] != '[')
+            return false;
+        for (position++; position < length && 0x30 <= input[position] && input[position] <= 0x3f; position++)
+            ;
+        for (; position < length && 0x20 <= input[position] && input[position] <= 0x2f; position++)
+            ;
+        if (position == length || !(('a' <= input[position] && input[position] <= 'z') || ('A' <= input[position] && input[position] <= 'Z')))
+            return false;
+        position++;
+    }
+
+    return true;
+}
+
+static bool starts_with(const char *data, size_t length, const char *prefix)
+{
+    size_t prefix_length = strlen(prefix);
+    return length >= prefix_length && !memcmp(data, prefix, prefix_length);
+}
+
+/* Sets color as the parameters of an SGR sequence do. Only the foreground color
+ * is followed. */
+static void apply_sgr(const char *parameters, size_t length, int32_t *color)
+{
+    int values[MAX_SGR_PARAMETERS] = { 0 };
+    int count = 1;
+
+    for (size_t i = 0; i < length; i++) {
+        if (parameters[i] == ';' && count < MAX_SGR_PARAMETERS)
+            count++;
+        else if ('0' <= parameters[i] && parameters[i] <= '9')
+            values[count - 1] = values[count - 1] * 10 + (parameters[i] - '0');
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (values[i] == 0 || values[i] == 39) {
+            *color = DEFAULT_COLOR;
+        } else if (30 <= values[i] && values[i] <= 37) {
+            *color = values[i] - 30;
+        } else if (90 <= values[i] && values[i] <= 97) {
+            *color = values[i] - 90 + 8;
+        } else if (values[i] == 38 && i + 2 < count && values[i + 1] == 5) {
+            *color = values[i + 2];
+            i += 2;
+        } else if (values[i] == 38 && i + 4 < count && values[i + 1] == 2) {
+            *color = RGB_COLOR | values[i + 2] << 16 | values[i + 3] << 8 | values[i + 4];
+            i += 4;
+        }
+    }
+}
+
+/* Reads the entity or character reference at the start of data. Returns its
+ * length, or 0 if there is none. */
+static size_t read_html_entity(const char *data, size_t length, wchar_t *character)
+{
+    const char *end = memchr(data, ';', length < 16 ? length : 16);
+    char *number_end;
+
+    if (end == NULL)
+        return 0;
+
+    if (starts_with(data, length, "&lt;")) {
+        *character = '<';
+    } else if (starts_with(data, length, "&gt;")) {
+        *character = '>';
+    } else if (starts_with(data, length, "&amp;")) {
+        *character = '&';
+    } else if (starts_with(data, length, "&#x")) {
+        *character = strtoul(data + strlen("&#x"), &number_end, 16);
+        if (number_end != end)
+            return 0;
+    } else {
+        return 0;
+    }
+
+    return end - data + 1;
+}
+
+/* Follows output as a terminal, or a browser for HTML, would, and adds the
+ * characters it draws, in the colors they are drawn in, to cells. */
+static void read_cells(const buffer_t *output, bool html, buffer_t *cells)
+{
+    int32_t color = DEFAULT_COLOR;
+    mbstate_t state;
+    size_t position = 0;
+
+    memset(&state, 0, sizeof(state));
+    while (position < output->length) {
+        const char *data = output->data + position;
+        size_t length = output->length - position;
+        size_t sequence_length;
+        wchar_t character;
+
+        if (html && starts_with(data, length, SPAN_OPEN) && length > strlen(SPAN_OPEN) + 6) {
+            color = RGB_COLOR | strtoul(data + strlen(SPAN_OPEN), NULL, 16);
+            position += strlen(SPAN_OPEN) + 6 + 1;
+            continue;
+        }
+        if (html && starts_with(data, length, SPAN_CLOSE)) {
+            color = DEFAULT_COLOR;
+            position += strlen(SPAN_CLOSE);
+            continue;
+        }
+
+        if (data[0] == '\033') {
+            /* Only control sequences set colors. Other escapes are two bytes here. */
+            size_t end = 2;
+            if (length > 1 && data[1] == '[') {
+                while (end < length && !(0x40 <= data[end] && data[end] <= 0x7e))
+                    end++;
+                if (end < length && data[end] == 'm' && !(0x3c <= data[2] && data[2] <= 0x3f))
+                    apply_sgr(data + 2, end - 2, &color);
+                end++;
+            }
+            position += end;
+            continue;
+        }
+
+        if (html && data[0] == '&' && (sequence_length = read_html_entity(data, length, &character)) > 0) {
+            /* An entity. */
+        } else {
+            sequence_length = mbrtowc(&character, data, length, &state);
+            if (sequence_length == (size_t)-1 || sequence_length == (size_t)-2) {
+                memset(&state, 0, sizeof(state));
+                position++;
+                continue;
+            }
+            if (sequence_length == 0)
+                sequence_length = 1;
+        }
+
+        if (wcwidth(character) > 0) {
+            cell_t cell = { .character = character, .color = color, .alternative = color };
+            buffer_append(cells, &cell, sizeof(cell));
+        }
+        position += sequence_length;
+    }
+}
+
+/* Returns whether cell is drawn in the color of the original's. */
+static bool same_color(const cell_t *original, const cell_t *cell)
+{
+    if (cell->color == original->color || cell->color == original->alternative)
+        return true;
+
+    if (cell->color < RGB_COLOR || original->color < RGB_COLOR)
+        return false;
+
+    for (int shift = 0; shift < 24; shift += 8) {
+        int difference = ((cell->color >> shift) & 0xff) - ((original->color >> shift) & 0xff);
+        if (difference > MAX_COLOR_DISTANCE || difference < -MAX_COLOR_DISTANCE)
+            return false;
+    }
+    return true;
+}
+
+static void format_color(int32_t color, char *text, size_t size)
+{
+    if (color == DEFAULT_COLOR)
+        snprintf(text, size, "the default color");
+    else if (color < RGB_COLOR)
+        snprintf(text, size, "color %d", (int)color);
+    else
+        snprintf(text, size, "#%06x", (unsigned int)(color & 0xffffff));
+}
+
+static bool same_result(const result_t *reference, const result_t *result)
+{
+    return result->status == reference->status
+        && result->output.length == reference->output.length
+        && !memcmp(result->output.data, reference->output.data, reference->output.length)
+        && !memcmp(&result->stats, &reference->stats, sizeof(reference->stats));
+}
+
+static void print_options(const queercat_options_t *options)
+{
+    fprintf(stderr, " (flag %d, %s, -h %g -v %g -o %g, rand_offset %d, colors %d, max_colors %d, min_run %d)\n",
+            queercat_pattern_number(options->pattern), color_type_names[options->color_type],
+            options->freq_h, options->freq_v, options->offx, options->rand_offset,
+            options->print_colors, options->max_colors, options->min_run);
+}
+
+static void report_mismatch(const char *path_name, const queercat_options_t *options, const result_t *reference, const result_t *result)
+{
+    size_t offset = 0;
+    while (offset < reference->output.length && offset < result->output.length
+            && reference->output.data[offset] == result->output.data[offset])
+        offset++;
+
+    fprintf(stderr, "%s differs from the reference at output byte %zu", path_name, offset);
+    print_options(options);
+    fprintf(stderr, "  status %d, %zu bytes, %zu escapes; reference: status %d, %zu bytes, %zu escapes\n",
+            result->status, result->output.length, result->stats.colorized_escape_sequences,
+            reference->status, reference->output.length, reference->stats.colorized_escape_sequences);
+}
+
+/* Checks that result draws the characters the original colorizer does, in the
+ * same colors, whatever escapes it takes to. Returns false after reporting the
+ * first cell that differs. */
+static bool same_cells(const char *path_name, const queercat_options_t *options, const buffer_t *original_cells, const result_t *result)
+{
+    buffer_t result_cells = { 0 };
+    char color[32], original_color[32];
+
+    read_cells(&result->output, options->print_colors && options->color_type == QUEERCAT_COLOR_TYPE_HTML, &result_cells);
+
+    const cell_t *originals = (const cell_t *)original_cells->data;
+    const cell_t *cells = (const cell_t *)result_cells.data;
+    size_t original_count = original_cells->length / sizeof(cell_t);
+    size_t count = result_cells.length / sizeof(cell_t);
+    size_t i = 0;
+
+    while (i < original_count && i < count && cells[i].character == originals[i].character && same_color(&originals[i], &cells[i]))
+        i++;
+
+    bool same = i == original_count && i == count && result->status == 0;
+    if (!same) {
+        fprintf(stderr, "%s draws cell %zu differently from the original colorizer", path_name, i);
+        print_options(options);
+        if (i < original_count && i < count) {
+            format_color(cells[i].color, color, sizeof(color));
+            format_color(originals[i].color, original_color, sizeof(original_color));
+            fprintf(stderr, "  U+%04X in %s; original: U+%04X in %s\n",
+                    (unsigned int)cells[i].character, color, (unsigned int)originals[i].character, original_color);
+        } else {
+            fprintf(stderr, "  status %d, %zu cells; original: %zu cells\n", result->status, count, original_count);
+        }
+    }
+
+    free(result_cells.data);
+    return same;
+}
+
+/* Colorizes input every way there is, with options picked from seed, and checks
+ * the outputs against the reference. Plain inputs are also checked against the
+ * original colorizer, when neither max_colors nor min_run changes the colors.
+ * Returns false after reporting a mismatch. */
+static bool check_input(const uint8_t *input, size_t length, uint32_t seed)
+{
+    queercat_options_t options;
+    result_t reference = { 0 };
+    result_t chunked = { 0 };
+    result_t parallel = { 0 };
+    bool same = true;
+
+    pick_options(&seed, &options);
+
+    colorize_reference(&options, input, length, &reference);
+    colorize_chunked(&options, input, length, seed, &chunked);
+    colorize_parallel(&options, input, length, seed, &parallel);
+
+    if (!same_result(&reference, &chunked)) {
+        report_mismatch("queercat_colorize", &options, &reference, &chunked);
+        same = false;
+    }
+    if (!same_result(&reference, &parallel)) {
+        report_mismatch("queercat_colorize_parallel", &options, &reference, &parallel);
+        same = false;
+    }
+
+    if (options.max_colors == 0 && options.min_run == 0 && plain_input(input, length)) {
+        buffer_t original = { 0 };
+        buffer_t alternatives = { 0 };
+        buffer_t original_cells = { 0 };
+
+        colorize_original(&options, input, length, &original, &alternatives);
+        read_cells(&original, false, &original_cells);
+
+        /* Without colors there are no alternatives, nor any need for them. */
+        cell_t *cells = (cell_t *)original_cells.data;
+        const int32_t *alternative = (const int32_t *)alternatives.data;
+        for (size_t i = 0; i < alternatives.length / sizeof(*alternative) && i < original_cells.length / sizeof(*cells); i++)
+            cells[i].alternative = alternative[i];
+
+        same = same_cells("queercat_colorize_char", &options, &original_cells, &reference) && same;
+        same = same_cells("queercat_colorize", &options, &original_cells, &chunked) && same;
+        same = same_cells("queercat_colorize_parallel", &options, &original_cells, &parallel) && same;
+
+        free(original.data);
+        free(alternatives.data);
+        free(original_cells.data);
+    }
+
+    free(reference.output.data);
+    free(chunked.output.data);
+    free(parallel.output.data);
+    return same;
+}
+
+#ifdef QUEERCAT_LIBFUZZER
+/* libFuzzer entry point. The first 4 bytes pick the options and the pieces. */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint32_t seed = 0;
+
+    if (size < sizeof(seed))
+        return 0;
+
+    memcpy(&seed, data, sizeof(seed));
+    if (setlocale(LC_CTYPE, "C.UTF-8") == NULL)
+        abort();
+
+    if (!check_input(data + sizeof(seed), size - sizeof(seed), seed))
+        abort();
+
+    return 0;
+}
+
+#else
+/* Checks random inputs, or the given files (for AFL, with "@@"). Each random
+ * input can be checked again on its own with its seed. */
+int main(int argc, char** argv)
+{
+    static uint8_t input[LARGE_INPUT_SIZE];
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    uint32_t first_seed = 1;
+    int i;
+
+    /* Handle options. */
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 < argc && (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--iterations"))) {
+            iterations = strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--seed"))) {
+            first_seed = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: queercat-fuzz [-n iterations] [-s seed] [FILES...]\n");
+            return 1;
+        }
+    }
+    bool files = i < argc;
+
+    if (setlocale(LC_CTYPE, "C.UTF-8") == NULL) {
+        fprintf(stderr, "The C.UTF-8 locale is needed for the reference decoder\n");
+        return 1;
+    }
+
+    int failures = 0;
+
+    /* Files, with the options picked from the first seed. */
+    for (; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t length = fread(input, 1, sizeof(input), f);
+        fclose(f);
+
+        if (!check_input(input, length, first_seed)) {
+            fprintf(stderr, "  input: %s\n", argv[i]);
+            failures++;
+        }
+    }
+    if (files)
+        return failures ? 1 : 0;
+
+    for (unsigned long iteration = 0; iteration < iterations; iteration++) {
+        uint32_t seed = first_seed + iteration;
+        uint32_t input_seed = seed;
+        bool large = seed % LARGE_INPUT_INTERVAL == 0;
+        bool plain = seed % PLAIN_INPUT_INTERVAL == 0;
+        size_t length = generate_input(input, large ? LARGE_INPUT_SIZE : MAX_INPUT_SIZE, large, plain, &input_seed);
+
+        if (!check_input(input, length, seed)) {
+            fprintf(stderr, "  input: queercat-fuzz -n 1 -s %lu\n", (unsigned long)seed);
+            failures++;
+        }
+    }
+
+    printf("%lu inputs, %d mismatches\n", iterations, failures);
+    return failures ? 1 : 0;
+}
+#endif /* QUEERCAT_LIBFUZZER */
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat.h"
+#include "flag_file.h"
+
+
+/* *** Constants *****************************************************/
+#define MAX_LINE_LENGTH (1024)
+#define CACHE_SUFFIX ".cache"
+#define CACHE_MAGIC "QCFLAGS"
+#define CACHE_VERSION (1)
+#define WHITESPACE " \t\r\n"
+
+
+/* *** Types *********************************************************/
+/* The cache is a header, a record per flag, then the color table of each flag.
+ * It is only used while the flag file it was made from is unchanged. */
+typedef struct cache_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t color_table_size;
+    uint32_t count;
+    uint64_t source_size;
+    uint64_t source_inode;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+} cache_header_t;
+
+/* A flag, without the pointers of queercat_pattern_t. */
+typedef struct cache_record_s {
+    char name[QUEERCAT_MAX_FLAG_NAME_LENGTH];
+    queercat_ansii_pattern_t ansii_pattern;
+    queercat_color_pattern_t color_pattern;
+} cache_record_t;
+
+
+/* *** Functions Declarations ****************************************/
+/* Flag files */
+static char *trim(char *text);
+static int syntax_error(const char *path, int line_number, const char *message);
+static int parse_value(queercat_pattern_t *pattern, const char *key, char *value);
+static int parse_flag_file(const char *path, queercat_pattern_t **patterns, int *count);
+
+/* Cache */
+static void describe_source(const struct stat *st, cache_header_t *header);
+static bool valid_record(const cache_record_t *record);
+static int load_cache(const char *cache_path, const struct stat *st, queercat_pattern_t **patterns, int *count);
+static void write_cache(const char *cache_path, const struct stat *st, const queercat_pattern_t *patterns, int count);
+
+
+/* *** Functions *****************************************************/
+static char *trim(char *text)
+{
+    text += strspn(text, WHITESPACE);
+
+    char *end = text + strlen(text);
+    while (end > text && strchr(WHITESPACE, end[-1]))
+        *--end = '\0';
+
+    return text;
+}
+
+static int syntax_error(const char *path, int line_number, const char *message)
+{
+    fwprintf(stderr, L"%s:%d: %s\n", path, line_number, message);
+    return -1;
+}
+
+/* Returns 0, or -1 if the value is invalid. */
+static int parse_value(queercat_pattern_t *pattern, const char *key, char *value)
+{
+    char *save;
+    char *endptr;
+
+    if (!strcmp(key, "stripes")) {
+        pattern->color_pattern.stripes_count = 0;
+        for (char *word = strtok_r(value, WHITESPACE, &save); word != NULL; word = strtok_r(NULL, WHITESPACE, &save)) {
+            if (pattern->color_pattern.stripes_count == QUEERCAT_MAX_FLAG_STRIPES)
+                return -1;
+
+            unsigned long color = strtoul(word + (*word == '#'), &endptr, 16);
+            if (*endptr || endptr == word + (*word == '#') || color > 0xffffff)
+                return -1;
+
+            pattern->color_pattern.stripes_colors[pattern->color_pattern.stripes_count++] = color;
+        }
+        return 0;
+
+    } else if (!strcmp(key, "ansi")) {
+        pattern->ansii_pattern.codes_count = 0;
+        for (char *word = strtok_r(value, WHITESPACE, &save); word != NULL; word = strtok_r(NULL, WHITESPACE, &save)) {
+            if (pattern->ansii_pattern.codes_count == QUEERCAT_MAX_ANSII_CODES_COUNT)
+                return -1;
+
+            unsigned long code = strtoul(word, &endptr, 10);
+            if (*endptr || code > 255)
+                return -1;
+
+            pattern->ansii_pattern.ansii_codes[pattern->ansii_pattern.codes_count++] = code;
+        }
+        return 0;
+
+    } else if (!strcmp(key, "factor")) {
+        pattern->color_pattern.factor = strtof(value, &endptr);
+        return (*endptr || endptr == value || !(pattern->color_pattern.factor > 0)) ? -1 : 0;
+    }
+
+    return -1;
+}
+
+/* Reads flags like:
+ *
+ *     [name]
+ *     stripes = #55cdfc #f7a8b8 #ffffff
+ *     factor = 4
+ *     ansi = 81 217 231
+ *
+ * A flag without stripes gets the rainbow gradient. */
+static int parse_flag_file(const char *path, queercat_pattern_t **patterns, int *count)
+{
+    char line[MAX_LINE_LENGTH];
+    queercat_pattern_t *pattern = NULL;
+    int section_line = 0;
+    int line_number;
+    int status = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fwprintf(stderr, L"Cannot open flag file \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    *patterns = NULL;
+    *count = 0;
+
+    for (line_number = 1; status == 0 && fgets(line, sizeof(line), f) != NULL; line_number++) {
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            status = syntax_error(path, line_number, "Line too long");
+            break;
+        }
+
+        char *text = trim(line);
+        if (*text == '\0' || *text == '#')
+            continue;
+
+        if (*text == '[') {
+            char *end = strchr(text, ']');
+            if (end == NULL || end[1] != '\0' || end == text + 1 || end - text - 1 >= QUEERCAT_MAX_FLAG_NAME_LENGTH) {
+                status = syntax_error(path, line_number, "Invalid flag name");
+                break;
+            }
+
+            if (pattern != NULL && pattern->ansii_pattern.codes_count == 0) {
+                status = syntax_error(path, section_line, "Flag has no ansi codes");
+                break;
+            }
+
+            queercat_pattern_t *grown = realloc(*patterns, (*count + 1) * sizeof(*grown));
+            if (grown == NULL) {
+                fwprintf(stderr, L"%s: %s\n", path, strerror(errno));
+                status = -1;
+                break;
+            }
+            *patterns = grown;
+
+            pattern = &grown[(*count)++];
+            memset(pattern, 0, sizeof(*pattern));
+            memcpy(pattern->name, text + 1, end - text - 1);
+            pattern->color_pattern.factor = 1.0f;
+            section_line = line_number;
+            continue;
+        }
+
+        char *value = strchr(text, '=');
+        if (pattern == NULL || value == NULL) {
+            status = syntax_error(path, line_number, "Expected [name] or key = value");
+            break;
+        }
+
+        *value++ = '\0';
+        char *key = trim(text);
+        if (parse_value(pattern, key, trim(value)) < 0)
+            status = syntax_error(path, line_number, "Invalid value, or unknown key");
+    }
+
+    if (status == 0 && ferror(f)) {
+        fwprintf(stderr, L"Error reading flag file \"%s\": %s\n", path, strerror(errno));
+        status = -1;
+    }
+
+    if (status == 0 && pattern != NULL && pattern->ansii_pattern.codes_count == 0)
+        status = syntax_error(path, section_line, "Flag has no ansi codes");
+
+    fclose(f);
+
+    if (status < 0) {
+        free(*patterns);
+        return -1;
+    }
+
+    for (int i = 0; i < *count; i++)
+        (*patterns)[i].get_color = (*patterns)[i].color_pattern.stripes_count > 0 ? queercat_get_color_stripes : queercat_get_color_rainbow;
+
+    return 0;
+}
+
+static void describe_source(const struct stat *st, cache_header_t *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header->version = CACHE_VERSION;
+    header->record_size = sizeof(cache_record_t);
+    header->color_table_size = QUEERCAT_COLOR_TABLE_SIZE;
+    header->source_size = st->st_size;
+    header->source_inode = st->st_ino;
+    header->source_mtime_sec = st->st_mtim.tv_sec;
+    header->source_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Checks a flag of the cache against the limits parse_flag_file enforces, which
+ * the rest of queercat relies on. */
+static bool valid_record(const cache_record_t *record)
+{
+    return record->name[0] != '\0'
+        && memchr(record->name, '\0', sizeof(record->name)) != NULL
+        && record->ansii_pattern.codes_count > 0
+        && record->ansii_pattern.codes_count <= QUEERCAT_MAX_ANSII_CODES_COUNT
+        && record->color_pattern.stripes_count <= QUEERCAT_MAX_FLAG_STRIPES
+        && record->color_pattern.factor > 0;
+}
+
+/* Maps the cache and points the flags' color tables into it, for the rest of the
+ * run. Returns 0, or -1 if there is no valid cache for this version of the flag
+ * file. */
+static int load_cache(const char *cache_path, const struct stat *st, queercat_pattern_t **patterns, int *count)
+{
+    cache_header_t expected;
+    struct stat cache_st;
+
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &cache_st) || (size_t)cache_st.st_size < sizeof(expected)) {
+        close(fd);
+        return -1;
+    }
+
+    const uint8_t *data = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    /* Everything but the count must match. */
+    const cache_header_t *header = (const cache_header_t *)data;
+    describe_source(st, &expected);
+    expected.count = header->count;
+
+    size_t flag_size = sizeof(cache_record_t) + QUEERCAT_COLOR_TABLE_SIZE * sizeof(queercat_color_t);
+    if (memcmp(header, &expected, sizeof(expected))
+            || header->count > INT_MAX
+            || header->count != ((size_t)cache_st.st_size - sizeof(*header)) / flag_size
+            || ((size_t)cache_st.st_size - sizeof(*header)) % flag_size != 0
+            || (*patterns = calloc(header->count, sizeof(**patterns))) == NULL) {
+        munmap((void *)data, cache_st.st_size);
+        return -1;
+    }
+
+    const cache_record_t *records = (const cache_record_t *)(header + 1);
+    const queercat_color_t *colors = (const queercat_color_t *)(records + header->count);
+
+    *count = header->count;
+    for (int i = 0; i < *count; i++) {
+        queercat_pattern_t *pattern = &(*patterns)[i];
+
+        if (!valid_record(&records[i])) {
+            free(*patterns);
+            munmap((void *)data, cache_st.st_size);
+            return -1;
+        }
+
+        memcpy(pattern->name, records[i].name, sizeof(pattern->name));
+        pattern->ansii_pattern = records[i].ansii_pattern;
+        pattern->color_pattern = records[i].color_pattern;
+        pattern->get_color = pattern->color_pattern.stripes_count > 0 ? queercat_get_color_stripes : queercat_get_color_rainbow;
+        pattern->color_table = colors + (size_t)i * QUEERCAT_COLOR_TABLE_SIZE;
+    }
+
+    return 0;
+}
+
+/* Writes the cache next to the flag file, if it can. Readers see either the old
+ * cache or the new one, never part of it. */
+static void write_cache(const char *cache_path, const struct stat *st, const queercat_pattern_t *patterns, int count)
+{
+    cache_header_t header;
+    char temp_path[PATH_MAX];
+
+    if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", cache_path) >= (int)sizeof(temp_path))
+        return;
+
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+        return;
+
+    FILE *f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+
+    describe_source(st, &header);
+    header.count = count;
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (int i = 0; i < count; i++) {
+        cache_record_t record;
+
+        memset(&record, 0, sizeof(record));
+        memcpy(record.name, patterns[i].name, sizeof(record.name));
+        record.ansii_pattern = patterns[i].ansii_pattern;
+        record.color_pattern = patterns[i].color_pattern;
+        fwrite(&record, sizeof(record), 1, f);
+    }
+
+    for (int i = 0; i < count; i++)
+        fwrite(patterns[i].color_table, sizeof(queercat_color_t), QUEERCAT_COLOR_TABLE_SIZE, f);
+
+    bool failed = ferror(f);
+    if (fclose(f) || failed || rename(temp_path, cache_path))
+        unlink(temp_path);
+}
+
+int load_flag_file(const char *path, bool optional)
+{
+    char cache_path[PATH_MAX];
+    queercat_pattern_t *patterns;
+    int count;
+    struct stat st;
+
+    if (stat(path, &st)) {
+        if (optional && errno == ENOENT)
+            return 0;
+        fwprintf(stderr, L"Cannot open flag file \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    bool can_cache = snprintf(cache_path, sizeof(cache_path), "%s" CACHE_SUFFIX, path) < (int)sizeof(cache_path);
+
+    if (!can_cache || load_cache(cache_path, &st, &patterns, &count) < 0) {
+        if (parse_flag_file(path, &patterns, &count) < 0)
+            return -1;
+
+        /* Precompute the colors once, for the cache and for this run. */
+        queercat_color_t *colors = malloc((size_t)count * QUEERCAT_COLOR_TABLE_SIZE * sizeof(queercat_color_t));
+        if (colors == NULL && count > 0) {
+            fwprintf(stderr, L"%s: %s\n", path, strerror(errno));
+            free(patterns);
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            queercat_build_color_table(&patterns[i], colors + (size_t)i * QUEERCAT_COLOR_TABLE_SIZE);
+            patterns[i].color_table = colors + (size_t)i * QUEERCAT_COLOR_TABLE_SIZE;
+        }
+
+        if (can_cache)
+            write_cache(cache_path, &st, patterns, count);
+    }
+
+    /* The flags stay loaded until exit. */
+    if (queercat_add_patterns(patterns, count) < 0) {
+        fwprintf(stderr, L"Cannot add the flags of \"%s\": %s\n", path,
+                (errno == EEXIST) ? "A flag of that name already exists" : strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int load_user_flags(void)
+{
+    const char *config_home = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    char path[PATH_MAX];
+
+    if (config_home != NULL && *config_home != '\0')
+        snprintf(path, sizeof(path), "%s/queercat/flags", config_home);
+    else if (home != NULL)
+        snprintf(path, sizeof(path), "%s/.config/queercat/flags", home);
+    else
+        return 0;
+
+    return load_flag_file(path, true);
+}
@@ -0,0 +1,18 @@
+#ifndef FLAG_FILE_H
+#define FLAG_FILE_H
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+
+
+/* *** Functions *****************************************************/
+/* Adds the flags of a flag file, from its binary cache when that is up to date,
+ * or else from the file itself, writing the cache for next time. A missing file
+ * is fine if optional. Returns 0, or -1 after reporting the error to stderr. */
+int load_flag_file(const char *path, bool optional);
+
+/* Loads the user's flags, from $XDG_CONFIG_HOME/queercat/flags or
+ * ~/.config/queercat/flags, if there are any. Returns like load_flag_file. */
+int load_user_flags(void);
+
+#endif /* FLAG_FILE_H */
@@ -3,356 +3,134 @@
 
 /* *** Includes ******************************************************/
 #include <stdbool.h>
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <time.h>
-#include "math.h"
-
-
-/* *** Common ********************************************************/
-/* Constants */
-#define NEWLINE '\n'
-#define ESCAPE_CHAR '\033'
-
-/* Types */
-typedef enum escape_state_e {
-    ESCAPE_STATE_OUT = 0,
-    ESCAPE_STATE_IN,
-    ESCAPE_STATE_LAST
-} escape_state_t;
-
-/* Macros */
-#define UNUSED(var) ((void)(var))
-#define NEXT_CYCLIC_ELEMENT(array, index, array_size) \
-    (((index) + 1 == (array_size)) ? (array)[0] : (array)[((index) + 1)] )
-#define IS_LETTER(c) (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z'))
+#include "flag_file.h"
+#include "prefetch.h"
+#include "queercat.h"
+#include "server.h"
 
 
 /* *** Constants *****************************************************/
-
-#define MAX_FLAG_STRIPES (6)
-#define MAX_ANSII_CODES_PER_STRIPE (5)
-#define MAX_ANSII_CODES_COUNT (MAX_FLAG_STRIPES * MAX_ANSII_CODES_PER_STRIPE)
-#define MAX_FLAG_NAME_LENGTH (64)
+#define INPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define PIPELINE_BUFFERS (4)
+#define COPY_CHUNK_SIZE (16 * 1024 * 1024)
+#define MAX_JOBS_PER_CORE (4)
+#define DEFAULT_ANIMATION_FPS (20)
+#define DEFAULT_ANIMATION_FRAMES (12)
+#define HIDE_CURSOR "\033[?25l"
+#define SHOW_CURSOR "\033[0m\033[?25h"
 
 
 /* *** Types *********************************************************/
-/* Colors. */
-typedef uint32_t hex_color_t;
-typedef unsigned char ansii_code_t;
-typedef struct color_s {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-} color_t;
-
-/* Color type patterns. */
-typedef enum color_type_e {
-    COLOR_TYPE_INVALID = -1,
-    COLOR_TYPE_ANSII = 0,
-    COLOR_TYPE_24_BIT,
-    COLOR_TYPE_COUNT
-} color_type_t;
-typedef struct ansii_pattern_s {
-    const unsigned int codes_count;
-    const unsigned char ansii_codes[MAX_ANSII_CODES_COUNT];
-} ansii_pattern_t;
-typedef struct color_pattern_s {
-    const uint8_t stripes_count;
-    const uint32_t stripes_colors[MAX_FLAG_STRIPES];
-    const float factor;
-} color_pattern_t;
-
-/* Get color function. */
-typedef void(get_color_f)(const color_pattern_t *color_pattern, float theta, color_t *color);
-
-/* Pattern. */
-typedef struct pattern_s {
-    const char name[MAX_FLAG_NAME_LENGTH];
-    const ansii_pattern_t ansii_pattern;
-    const color_pattern_t color_pattern;
-    get_color_f *get_color;
-} pattern_t;
-
-/* *** A Single Global ***********************************************/
+/* When buffered output is written. */
+typedef enum flush_policy_e {
+    FLUSH_POLICY_AUTO = 0, /* Whenever the input has nothing more to read yet. */
+    FLUSH_POLICY_LINE,     /* After each line. */
+    FLUSH_POLICY_BLOCK     /* Only once the buffer is full. */
+} flush_policy_t;
+
+/* Ways the kernel copies input to output, in the order they are tried. */
+typedef enum copy_method_e {
+    COPY_METHOD_COPY_FILE_RANGE = 0, /* Between regular files. */
+    COPY_METHOD_SPLICE,              /* From or to a pipe. */
+    COPY_METHOD_SENDFILE,            /* From a regular file. */
+    COPY_METHOD_COUNT
+} copy_method_t;
+
+/* Buffers handed from one thread to another, in order. The queue has room for
+ * all the buffers of its stage, so pushing never waits. */
+typedef struct buffer_s {
+    char *data;
+    size_t length;
+} buffer_t;
+typedef struct buffer_queue_s {
+    buffer_t buffers[PIPELINE_BUFFERS];
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} buffer_queue_t;
+
+/* A thread reading or writing fd, with the buffers filled for it or by it, and
+ * the ones free to fill. */
+typedef struct stage_s {
+    int fd;
+    pthread_t thread;
+    buffer_queue_t full;
+    buffer_queue_t free;
+    int error; /* Set by the thread before it gives back the buffer that failed. */
+} stage_t;
+
+/* Animated output: frames paced to a rate, and the line being read. */
+typedef struct animation_s {
+    struct output_buffer_s *output;
+    int frames;  /* Per line. */
+    int columns; /* Of the terminal, or 0 if unknown. */
+    long frame_nanoseconds;
+    struct timespec next_frame;
+    char *line;
+    size_t line_length;
+    size_t line_capacity;
+} animation_t;
+
+/* Output, of OUTPUT_BUFFER_SIZE bytes at a time. */
+typedef struct output_buffer_s {
+    int fd;
+    flush_policy_t flush_policy;
+    size_t length;
+    char *data;
+    stage_t *writer; /* The thread writing the output, or NULL to write it right away. */
+} output_buffer_t;
+
+/* What --stats reports. Nothing is measured unless it is enabled. */
+typedef struct stats_s {
+    bool enabled;
+    const queercat_t *queercat; /* For its counts, until it is destroyed. */
+    queercat_stats_t counts;
+    size_t input_bytes;
+    size_t input_chars;
+    struct timespec start;
+    double setup_seconds;
+    double read_seconds;
+    double write_seconds;
+    double count_seconds; /* Spent counting for the report, and left out of it. */
+    double wait_seconds;  /* Spent by the main thread waiting for the reader and writer. */
+    double main_seconds;  /* Spent by the main thread on anything but colorizing. */
+    pthread_t main_thread;
+} stats_t;
+
+/* *** Globals *******************************************************/
 char *helpstr;
+static stats_t stats;
 
-/* *** Pattern Functions *********************************************/
-get_color_f get_color_rainbow;
-get_color_f get_color_stripes;
-
-
-/* *** Flags *********************************************************/
-const pattern_t flags[] = {
-    {
-        .name = "rainbow",
-        .ansii_pattern = {
-            .codes_count = 30,
-            .ansii_codes = { 39, 38, 44, 43, 49, 48, 84, 83, 119, 118, 154, 148, 184, 178,
-                214, 208, 209, 203, 204, 198, 199, 163, 164, 128, 129, 93, 99, 63, 69, 33 }
-        },
-        .color_pattern = { 0 },
-        .get_color = get_color_rainbow
-    },
-
-    {
-        .name = "transgender",
-        .ansii_pattern = {
-            .codes_count = 10,
-            .ansii_codes = {81, 81, 217, 217,  231, 231,  217, 217,  81, 81}
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0x55cdfc, /* #55cdfc - Blue */
-                0xf7a8b8, /* #f7a8b8 - Pink */
-                0xffffff, /* #ffffff - White */
-                0xf7a8b8, /* #f7a8b8 - Pink */
-                0x55cdfc  /* #55cdfc - Blue */
-            },
-            .factor = 4.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "nonbinary",
-        .ansii_pattern = {
-            .codes_count = 8,
-            .ansii_codes = {226, 226, 255, 255, 93, 93, 234, 234}
-        },
-        .color_pattern = {
-            .stripes_count = 4,
-            .stripes_colors = {
-                0xffff00, /* #ffff00 - Yellow */
-                0xb000ff, /* #b000ff - Purple */
-                0xffffff, /* #ffffff - White */
-                0x000000  /* #000000 - Black */
-            },
-            .factor = 4.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "lesbian",
-        .ansii_pattern = {
-            .codes_count = 5,
-            .ansii_codes = {196, 208, 255, 170, 128}
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0xff0000, /* #ff0000 - Red */
-                0xff993f, /* #ff993f - Orange */
-                0xffffff, /* #ffffff - White */
-                0xff8cbd, /* #ff8cbd - Pink */
-                0xff4284  /* #ff4284 - Purple */
-            },
-            .factor = 2.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "gay",
-        .ansii_pattern = {
-            .codes_count = 7,
-            .ansii_codes = {36, 49, 121, 255, 117, 105, 92}
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0x00b685, /* #00b685 - Teal */
-                0x6bffb6, /* #6bffb6 - Green */
-                0xffffff, /* #ffffff - White */
-                0x8be1ff, /* #8be1ff - Blue */
-                0x8e1ae1  /* #8e1ae1 - Purple */
-            },
-            .factor = 6.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "pansexual",
-        .ansii_pattern = {
-            .codes_count = 9,
-            .ansii_codes = {200, 200, 200,  227, 227, 227,  45, 45, 45}
-        },
-        .color_pattern = {
-            .stripes_count = 3,
-            .stripes_colors = {
-                0xff3388, /* #ff3388 - Pink */
-                0xffea00, /* #ffea00 - Yellow */
-                0x00dbff  /* #00dbff - Cyan */
-            },
-            .factor = 8.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "bisexual",
-        .ansii_pattern = {
-            .codes_count = 8,
-            .ansii_codes = {162, 162, 162,  129, 129, 27, 27, 27}
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0xff3b7b, /* #ff3b7b - Pink */
-                0xff3b7b, /* #ff3b7b - Pink */
-                0xd06bcc, /* #d06bcc - Purple */
-                0x3b72ff, /* #3b72ff - Blue */
-                0x3b72ff  /* #3b72ff - Blue */
-            },
-            .factor = 4.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "gender_fluid",
-        .ansii_pattern = {
-            .codes_count = 10,
-            .ansii_codes = {219, 219, 255, 255, 128, 128, 234, 234, 20, 20}
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0xffa0bc, /* #ffa0bc - Pink */
-                0xffffff, /* #ffffff - White */
-                0xc600e4, /* #c600e4 - Purple */
-                0x000000, /* #000000 - Black */
-                0x4e3cbb  /* #4e3cbb - Blue */
-            },
-            .factor = 2.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "asexual",
-        .ansii_pattern = {
-            .codes_count = 8,
-            .ansii_codes = {233, 233, 247, 247, 255, 255, 5, 5}
-        },
-        .color_pattern = {
-            .stripes_count = 4,
-            .stripes_colors = {
-                0x000000, /* #000000 - Black */
-                0xa3a3a3, /* #a3a3a3 - Gray */
-                0xffffff, /* #ffffff - White */
-                0x800080  /* #800080 - Purple */
-            },
-            .factor = 4.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "unlabeled",
-        .ansii_pattern = {
-            .codes_count = 8,
-            .ansii_codes = {194, 194, 255, 255, 195, 195, 223, 223}
-        },
-        .color_pattern = {
-            .stripes_count = 4,
-            .stripes_colors = {
-                0xe6f9e3, /* #e6f9e3 - Green */
-                0xfdfdfb, /* #fdfdfb - White */
-                0xdeeff9, /* #deeff9 - Blue */
-                0xfae1c2  /* #fae1c2 - Orange */
-            },
-            .factor = 4.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "aromantic",
-        .ansii_pattern = {
-            .codes_count = 10,
-            .ansii_codes = {
-                34, 34,
-                120, 120,
-                255, 255,
-                247, 247,
-                233, 233
-            }
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0x3da542, /* #3da542 - Green        */
-                0xa8d379, /* #a8d379 - Light green  */
-                0xffffff, /* #ffffff - White        */
-                0xa9a9a9, /* #a9a9a9 - Grey         */
-                0x000000  /* #000000 - Black        */
-            },
-            .factor = 1.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "aroace",
-        .ansii_pattern = {
-            .codes_count = 10,
-            .ansii_codes = {
-                208, 208,
-                220, 220,
-                255, 255,
-                75, 75,
-                62, 62
-            },
-        },
-        .color_pattern = {
-            .stripes_count = 5,
-            .stripes_colors = {
-                0xe28d00, /* #e28d00 - Orange     */
-                0xeccd00, /* #eccd00 - Yellow     */
-                0xffffff, /* #ffffff - White      */
-                0x62afdd, /* #62afdd - Light blue */
-                0x203756  /* #203756 - Blue       */
-            },
-            .factor = 1.0f
-        },
-        .get_color = get_color_stripes
-    },
-
-    {
-        .name = "sapphic",
-        .ansii_pattern = {
-            .codes_count = 8,
-            .ansii_codes = {97, 97, 204, 204, 221, 221, 77, 77}
-        },
-        .color_pattern = {
-            .stripes_count = 4,
-            .stripes_colors = {
-                0x663399, /* #663399 - Purple */
-                0xff6699, /* #ff6699 - Pink */
-                0xffcc33, /* #ffcc33 - Yellow */
-                0x66cc33  /* #66cc33 - Green */
-            },
-            .factor = 1.0f
-        },
-        .get_color = get_color_stripes
-    },
-    /* Add new flags above this line. */
-};
-
-const int FLAG_COUNT = sizeof(flags)/sizeof(flags[0]);
+/* The input file colorized from its mapping, and whether it turned out to be
+ * truncated while it was, as a log being rotated is. */
+static const uint8_t *volatile mapped_data;
+static volatile size_t mapped_length;
+static size_t page_size;
+static volatile sig_atomic_t mapped_truncated;
 
 /* *** Functions Declarations ****************************************/
 /* Info */
@@ -362,13 +140,53 @@ static void version(void);
 /* Helpers */
 static void build_helpstr(void);
 static void cleanup_helpstr(void);
-static void find_escape_sequences(wint_t current_char, escape_state_t *state);
-static wint_t helpstr_hack(FILE * _ignored);
-static const pattern_t * lookup_pattern(const char *name);
 
-/* Colors handling */
-static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color);
-static void print_color(const pattern_t *pattern, color_type_t color_type, int char_index, int line_index, double freq_h, double freq_v, double offx, int rand_offset, int cc);
+/* Statistics */
+static void stats_start(struct timespec *start);
+static void stats_stop(const struct timespec *start, double *seconds);
+static void stats_count_input(const void *data, size_t length, double *seconds);
+static void print_stats(void);
+
+/* Pipeline */
+static void queue_init(buffer_queue_t *queue);
+static void queue_push(buffer_queue_t *queue, buffer_t buffer);
+static bool queue_pop(buffer_queue_t *queue, buffer_t *buffer);
+static void queue_close(buffer_queue_t *queue);
+static bool queue_empty(buffer_queue_t *queue);
+static stage_t *start_stage(int fd, size_t buffer_size, void *(*run)(void *));
+static void *writer_thread(void *arg);
+static void *reader_thread(void *arg);
+
+/* Output handling */
+static int write_all(int fd, const char *data, size_t length);
+static void write_error(int error);
+static void output_flush(output_buffer_t *output);
+static void output_drain(output_buffer_t *output);
+static void output_finish(output_buffer_t *output);
+static void output_flush_lines(output_buffer_t *output);
+static void output_write(void *cookie, const void *data, size_t length);
+static void output_reserve(output_buffer_t *output);
+
+/* Input handling */
+static bool input_idle(int fd);
+static int colorize_buffer(queercat_t *queercat, output_buffer_t *output, const void *data, size_t length);
+static int colorize_fd(queercat_t *queercat, output_buffer_t *output, int fd);
+static int colorize_fd_pipelined(queercat_t *queercat, output_buffer_t *output, int fd);
+static const uint8_t *map_file(int fd, size_t *length);
+static bool unmap_file(const uint8_t *data, size_t length);
+static void fill_truncated_on_signal(int signal_number, siginfo_t *info, void *context);
+static ssize_t copy_chunk(copy_method_t method, int in_fd, int out_fd);
+static int pass_through_fd(output_buffer_t *output, int fd);
+static int colorize_stream(queercat_t *queercat, output_buffer_t *output, FILE *f);
+
+/* Animation */
+static void show_cursor(void);
+static void show_cursor_on_signal(int signal_number);
+static void animation_write(void *cookie, const void *data, size_t length);
+static int animate_line(queercat_t *queercat, animation_t *animation, const char *line, size_t length);
+static int animate_lines(queercat_t *queercat, animation_t *animation, const char *data, size_t length);
+static int animate_rest(queercat_t *queercat, animation_t *animation);
+static int animate_fd(queercat_t *queercat, animation_t *animation, int fd);
 
 /* *** Functions *****************************************************/
 static void usage(void)
@@ -399,15 +217,34 @@ static void build_helpstr(void)
     static char helpstr_indent[] = "                                      ";
 
     static char helpstr_tail[] =
+        "                --flag-file <file>: Add the flags defined in <file>\n"
         "--horizontal-frequency <d>, -h <d>: Horizontal rainbow frequency (default: 0.23)\n"
-        "  --vertical-frequency <d>, -v <d>: Vertical rainbow frequency (default: 0.1)\n"
+        "  --vertical-frequency <d>, -v <d>: Vertical rainbow frequency (default: 0.1),\n"
+        "                                    0 for the same colors on every line\n"
         "              --offset <d>, -o <d>: Offset of the start of the flag\n"
         "                 --force-color, -F: Force color even when stdout is not a tty\n"
         "             --no-force-locale, -l: Use encoding from system locale instead of\n"
         "                                    assuming UTF-8\n"
         "                      --random, -r: Random colors\n"
-        "                       --24bit, -b: Output in 24-bit \"true\" RGB mode (slower and\n"
-        "                                    not supported by all terminals)\n"
+        "                       --24bit, -b: Output in 24-bit \"true\" RGB mode (not\n"
+        "                                    supported by all terminals)\n"
+        "                            --html: Output HTML, with 24-bit colors as spans\n"
+        "                --jobs <d>, -j <d>: Colorize regular files on <d> threads\n"
+        "                                    and read pipes and write output on\n"
+        "                                    threads of their own\n"
+        "                  --max-colors <d>: Use at most <d> bands of color, for smaller\n"
+        "                                    output\n"
+        "                     --min-run <d>: Keep each color for at least <d> columns\n"
+        "                     --animate, -a: Animate each line, when printing colors\n"
+        "                         --fps <d>: Frames per second (default: 20)\n"
+        "                    --duration <d>: Frames per line (default: 12)\n"
+        "                    --flush <mode>: When to write output: \"line\" after each\n"
+        "                                    line, \"block\" when the buffer is full,\n"
+        "                                    \"auto\" when input is idle (default)\n"
+        "                  --serve <socket>: Serve colorizing requests on a unix socket\n"
+        "                 --client <socket>: Have the server on <socket> colorize\n"
+        "                           --stats: Report sizes, counts and times to stderr\n"
+        "                                    at exit\n"
         "                         --version: Print version and exit\n"
         "                            --help: Show this message\n"
         "\n"
@@ -428,29 +265,30 @@ static void build_helpstr(void)
      * would be nice to have the dynamic word-wrap back, but that's
      * more clever than I currently feel like trying to be
      */
-    const int line_max_len = strlen(helpstr_indent) + MAX_FLAG_NAME_LENGTH + strlen(": 000\n") ;
-    char lines[FLAG_COUNT][line_max_len];
+    const int line_max_len = strlen(helpstr_indent) + QUEERCAT_MAX_FLAG_NAME_LENGTH + strlen(": 000\n") ;
+    const int flag_count = queercat_pattern_count();
+    char lines[flag_count][line_max_len];
     size_t lines_total_len = 0;
 
-    for(int i = 0; i < FLAG_COUNT; ++i) {
-        lines_total_len += snprintf(lines[i], line_max_len, "%s%s: %d\n", helpstr_indent, flags[i].name, i);
+    for(int i = 0; i < flag_count; ++i) {
+        lines_total_len += snprintf(lines[i], line_max_len, "%s%s: %d\n", helpstr_indent, queercat_pattern(i)->name, i);
     }
 
     size_t helpstr_len = strlen(helpstr_head) + lines_total_len + strlen(helpstr_tail);
 
-    char *out = malloc(helpstr_len);
+    char *out = malloc(helpstr_len + 1);
     char *out_pos = out;
 
     out_pos = mempcpy(out, helpstr_head, strlen(helpstr_head));
 
-    for(int i = 0; i < FLAG_COUNT; ++i) {
+    for(int i = 0; i < flag_count; ++i) {
         char* this_line = lines[i];
         out_pos = mempcpy(out_pos, this_line, strlen(this_line));
     }
 
-    memcpy(out_pos, helpstr_tail, strlen(helpstr_tail));
+    out_pos = mempcpy(out_pos, helpstr_tail, strlen(helpstr_tail));
+    *out_pos = '\0';
 
-    // TODO? maybe refactor helpstr_hack to not rely on helpstr being global to avoid needing to use atexit
     helpstr = out;
     atexit(cleanup_helpstr);
 }
@@ -460,153 +298,786 @@ static void cleanup_helpstr(void)
     free(helpstr);
 }
 
-static void find_escape_sequences(wint_t current_char, escape_state_t *state)
+static void stats_start(struct timespec *start)
 {
-    if (current_char == '\033') {
-        *state = ESCAPE_STATE_IN;
-    } else if (*state == ESCAPE_STATE_IN) {
-        *state = IS_LETTER(current_char) ? ESCAPE_STATE_LAST : ESCAPE_STATE_IN;
-    } else {
-        *state = ESCAPE_STATE_OUT;
+    if (stats.enabled)
+        clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/* Adds the time since start to seconds. What the main thread does besides
+ * colorizing also adds up to main_seconds, and the rest of its time is the
+ * colorize time. */
+static void stats_stop(const struct timespec *start, double *seconds)
+{
+    struct timespec end;
+
+    if (!stats.enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    *seconds += elapsed;
+    if (seconds != &stats.count_seconds && pthread_equal(pthread_self(), stats.main_thread))
+        stats.main_seconds += elapsed;
+}
+
+/* Counts UTF-8 input in a pass of its own, so that colorizing is left as is, and
+ * adds the time it took to seconds. */
+static void stats_count_input(const void *data, size_t length, double *seconds)
+{
+    const uint8_t *bytes = data;
+    struct timespec start;
+
+    if (!stats.enabled)
+        return;
+
+    stats_start(&start);
+    stats.input_bytes += length;
+    for (size_t i = 0; i < length; i++)
+        stats.input_chars += ((bytes[i] & 0xc0) != 0x80);
+    stats_stop(&start, seconds);
+}
+
+/* Reports to stderr at exit. Decoding and picking colors go character by
+ * character together, so their time is the colorize time. With a reader and a
+ * writer thread, their times overlap with it. */
+static void print_stats(void)
+{
+    struct timespec now;
+
+    if (stats.queercat != NULL)
+        queercat_get_stats(stats.queercat, &stats.counts);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double total_seconds = (now.tv_sec - stats.start.tv_sec) + (now.tv_nsec - stats.start.tv_nsec) / 1e9
+            - stats.count_seconds;
+    double colorize_seconds = total_seconds - stats.main_seconds;
+
+    fwprintf(stderr, L"            input bytes: %zu\n", stats.input_bytes);
+    fwprintf(stderr, L"            code points: %zu\n", stats.input_chars);
+    fwprintf(stderr, L"passed escape sequences: %zu\n", stats.counts.colorized_escape_sequences);
+    fwprintf(stderr, L"     ansi color escapes: %zu\n", stats.counts.color_escapes[QUEERCAT_COLOR_TYPE_ANSII]);
+    fwprintf(stderr, L"   24-bit color escapes: %zu\n", stats.counts.color_escapes[QUEERCAT_COLOR_TYPE_24_BIT]);
+    fwprintf(stderr, L"       html color spans: %zu\n", stats.counts.color_escapes[QUEERCAT_COLOR_TYPE_HTML]);
+    fwprintf(stderr, L"             setup time: %.6f s\n", stats.setup_seconds);
+    fwprintf(stderr, L"              read time: %.6f s\n", stats.read_seconds);
+    fwprintf(stderr, L"          colorize time: %.6f s\n", colorize_seconds);
+    fwprintf(stderr, L"             write time: %.6f s\n", stats.write_seconds);
+    fwprintf(stderr, L"              wait time: %.6f s\n", stats.wait_seconds);
+    fwprintf(stderr, L"             total time: %.6f s\n", total_seconds);
+    fwprintf(stderr, L"             throughput: %.1f MB/s\n",
+            total_seconds > 0 ? stats.input_bytes / total_seconds / (1024 * 1024) : 0.0);
+}
+
+static void queue_init(buffer_queue_t *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+static void queue_push(buffer_queue_t *queue, buffer_t buffer)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->buffers[(queue->head + queue->count++) % PIPELINE_BUFFERS] = buffer;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Waits for a buffer. Returns false once the queue is closed and empty. */
+static bool queue_pop(buffer_queue_t *queue, buffer_t *buffer)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+
+    bool popped = queue->count > 0;
+    if (popped) {
+        *buffer = queue->buffers[queue->head];
+        queue->head = (queue->head + 1) % PIPELINE_BUFFERS;
+        queue->count--;
     }
+    pthread_mutex_unlock(&queue->lock);
+
+    return popped;
+}
+
+static void queue_close(buffer_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_signal(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
 }
 
-static wint_t helpstr_hack(FILE * _ignored)
+static bool queue_empty(buffer_queue_t *queue)
 {
-    (void)_ignored;
-    static size_t idx = 0;
-    char c = helpstr[idx++];
-    if (c)
-        return c;
-    idx = 0;
-    return WEOF;
+    pthread_mutex_lock(&queue->lock);
+    bool empty = queue->count == 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    return empty;
 }
 
-/* returns NULL on failure */
-static const pattern_t * lookup_pattern(const char *name)
+/* Starts run on a stage with PIPELINE_BUFFERS free buffers, allocated along with
+ * it. Exits if that fails. */
+static stage_t *start_stage(int fd, size_t buffer_size, void *(*run)(void *))
 {
-    // check for name matches
-    for(int i = 0; i < FLAG_COUNT; ++i) {
-        if(!strcmp(name, flags[i].name))
-            return &flags[i];
+    stage_t *stage = malloc(sizeof(*stage) + PIPELINE_BUFFERS * buffer_size);
+    if (stage == NULL)
+        err(2, NULL);
+
+    stage->fd = fd;
+    stage->error = 0;
+    queue_init(&stage->full);
+    queue_init(&stage->free);
+    for (int i = 0; i < PIPELINE_BUFFERS; i++)
+        queue_push(&stage->free, (buffer_t){ .data = (char *)(stage + 1) + i * buffer_size, .length = 0 });
+
+    errno = pthread_create(&stage->thread, NULL, run, stage);
+    if (errno)
+        err(2, NULL);
+
+    return stage;
+}
+
+/* Writes the full buffers in order. After an error the rest is dropped, for the
+ * main thread to report. */
+static void *writer_thread(void *arg)
+{
+    stage_t *writer = arg;
+    buffer_t buffer;
+
+    while (queue_pop(&writer->full, &buffer)) {
+        if (writer->error == 0 && write_all(writer->fd, buffer.data, buffer.length) < 0)
+            writer->error = errno;
+        queue_push(&writer->free, buffer);
     }
 
-    // try number matches
-    char *endptr;
-    int flag_num = (int)strtoul(name, &endptr, 10);
+    return NULL;
+}
 
-    // left-over charaters, or number out of range
-    if(*endptr || (flag_num < 0 || flag_num >= FLAG_COUNT))
-        return NULL;
+/* Reads until the end of the input, or an error, then closes the full queue. */
+static void *reader_thread(void *arg)
+{
+    stage_t *reader = arg;
+    buffer_t buffer;
+
+    while (queue_pop(&reader->free, &buffer)) {
+        struct timespec start;
+        ssize_t bytes_read;
+
+        stats_start(&start);
+        do {
+            bytes_read = read(reader->fd, buffer.data, INPUT_BUFFER_SIZE);
+        } while (bytes_read < 0 && errno == EINTR);
+        stats_stop(&start, &stats.read_seconds);
+
+        if (bytes_read <= 0) {
+            if (bytes_read < 0)
+                reader->error = errno;
+            break;
+        }
+
+        buffer.length = bytes_read;
+        queue_push(&reader->full, buffer);
+    }
 
-    return &flags[flag_num];
+    queue_close(&reader->full);
+    return NULL;
 }
 
-static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, color_t *output_color)
+/* Returns 0, or -1 with errno set. */
+static int write_all(int fd, const char *data, size_t length)
 {
-    uint8_t red_1   = (color1 & 0xff0000) >> 16;
-    uint8_t green_1 = (color1 & 0x00ff00) >>  8;
-    uint8_t blue_1  = (color1 & 0x0000ff) >>  0;
+    struct timespec start;
+
+    stats_start(&start);
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    stats_stop(&start, &stats.write_seconds);
 
-    uint8_t red_2   = (color2 & 0xff0000) >> 16;
-    uint8_t green_2 = (color2 & 0x00ff00) >>  8;
-    uint8_t blue_2  = (color2 & 0x0000ff) >>  0;
+    return 0;
+}
 
-    balance = pow(balance, factor);
+static void write_error(int error)
+{
+    fwprintf(stderr, L"Error writing output: %s\n", strerror(error));
+    exit(2);
+}
 
-    output_color->red = lrintf(red_1 * balance + red_2 * (1.0f - balance));
-    output_color->green = lrintf(green_1 * balance + green_2 * (1.0f - balance));
-    output_color->blue = lrintf(blue_1 * balance + blue_2 * (1.0f - balance));
+/* Writes the buffered output, or hands it to the writer and goes on in a free
+ * buffer. */
+static void output_flush(output_buffer_t *output)
+{
+    stage_t *writer = output->writer;
+    struct timespec start;
+    buffer_t buffer = { 0 };
+
+    if (writer == NULL) {
+        if (write_all(output->fd, output->data, output->length) < 0)
+            write_error(errno);
+        output->length = 0;
+        return;
+    }
+
+    if (output->length == 0)
+        return;
+
+    queue_push(&writer->full, (buffer_t){ .data = output->data, .length = output->length });
+
+    stats_start(&start);
+    queue_pop(&writer->free, &buffer);
+    stats_stop(&start, &stats.wait_seconds);
+
+    if (writer->error)
+        write_error(writer->error);
+
+    output->data = buffer.data;
+    output->length = 0;
 }
 
-void get_color_rainbow (const color_pattern_t *color_pattern, float theta, color_t *color)
+/* Flushes the output and waits until all of it is written, for instance before
+ * reporting an error. */
+static void output_drain(output_buffer_t *output)
 {
-    /* Unused variables. */
-    UNUSED(color_pattern);
+    stage_t *writer = output->writer;
+    buffer_t buffers[PIPELINE_BUFFERS];
+    struct timespec start;
 
-    /* Get theta in range. */
-    while (theta < 0) theta += 2.0f * (float)M_PI;
-    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+    output_flush(output);
+    if (writer == NULL)
+        return;
 
-    /* Generate the color. */
-    color->red   = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 0            ))) * 255.0f);
-    color->green = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 2 * M_PI / 3 ))) * 255.0f);
-    color->blue  = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 4 * M_PI / 3 ))) * 255.0f);
+    /* Every buffer but the current one comes back once written. */
+    stats_start(&start);
+    for (int i = 0; i < PIPELINE_BUFFERS - 1; i++)
+        queue_pop(&writer->free, &buffers[i]);
+    stats_stop(&start, &stats.wait_seconds);
+
+    if (writer->error)
+        write_error(writer->error);
+
+    for (int i = 0; i < PIPELINE_BUFFERS - 1; i++)
+        queue_push(&writer->free, buffers[i]);
 }
 
-void get_color_stripes (const color_pattern_t *color_pattern, float theta, color_t *color)
+/* Drains the output and stops the writer. */
+static void output_finish(output_buffer_t *output)
 {
-    /* Get theta in range. */
-    while (theta < 0) theta += 2.0f * (float)M_PI;
-    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+    output_drain(output);
 
-    /* Find the stripe based on theta and generate the color. */
-    for (int i = 0; i < color_pattern->stripes_count; i++) {
-        float stripe_size = (2.0f * M_PI) / color_pattern->stripes_count;
-        float min_theta = i * stripe_size;
-        float max_theta = (i + 1) * stripe_size;
+    if (output->writer != NULL) {
+        queue_close(&output->writer->full);
+        pthread_join(output->writer->thread, NULL);
+    }
+}
 
-        if (min_theta <= theta && max_theta > theta) {
-            float balance = 1 - ((theta - min_theta) / stripe_size);
-            mix_colors(
-                    color_pattern->stripes_colors[i],
-                    NEXT_CYCLIC_ELEMENT(color_pattern->stripes_colors, i, color_pattern->stripes_count),
-                    balance,
-                    color_pattern->factor,
-                    color);
-            return;
-        }
+/* Writes the complete lines, keeping a partial last line buffered. */
+static void output_flush_lines(output_buffer_t *output)
+{
+    const char *newline = memrchr(output->data, '\n', output->length);
+    if (newline == NULL)
+        return;
+
+    size_t length = newline + 1 - output->data;
+    size_t rest = output->length - length;
+
+    if (output->writer == NULL) {
+        if (write_all(output->fd, output->data, length) < 0)
+            write_error(errno);
+        memmove(output->data, output->data + length, rest);
+        output->length = rest;
+        return;
+    }
+
+    /* The writer only reads the lines, so the rest can still be copied from there. */
+    const char *lines = output->data;
+    output->length = length;
+    output_flush(output);
+    memcpy(output->data, lines + length, rest);
+    output->length = rest;
+}
+
+/* A queercat_write_f. */
+static void output_write(void *cookie, const void *data, size_t length)
+{
+    output_buffer_t *output = cookie;
+
+    while (length > 0) {
+        if (output->length == OUTPUT_BUFFER_SIZE)
+            output_flush(output);
+
+        size_t part = OUTPUT_BUFFER_SIZE - output->length;
+        if (part > length)
+            part = length;
+
+        memcpy(output->data + output->length, data, part);
+        output->length += part;
+        data = (const char *)data + part;
+        length -= part;
     }
 }
 
-static void print_color(const pattern_t *pattern, color_type_t color_type, int char_index, int line_index, double freq_h, double freq_v, double offx, int rand_offset, int cc)
+/* Makes room for the colorizer to write to. */
+static void output_reserve(output_buffer_t *output)
 {
-    float theta;
-    color_t color = { 0 };
+    if (OUTPUT_BUFFER_SIZE - output->length < QUEERCAT_MIN_OUTPUT_SIZE)
+        output_flush(output);
+}
 
-    int ncc;
+static int colorize_buffer(queercat_t *queercat, output_buffer_t *output, const void *data, size_t length)
+{
+    for (;;) {
+        size_t consumed;
+        size_t written;
+
+        output_reserve(output);
+        int status = queercat_colorize(queercat, data, length, &consumed,
+                output->data + output->length, OUTPUT_BUFFER_SIZE - output->length, &written);
+        output->length += written;
+
+        if (status < 0 || consumed == length)
+            return status;
+
+        /* The output is full. */
+        data = (const char *)data + consumed;
+        length -= consumed;
+        output_flush(output);
+    }
+}
+
+/* Returns true if reading fd would block. */
+static bool input_idle(int fd)
+{
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
 
-    switch (color_type) {
-        case COLOR_TYPE_24_BIT:
-            theta = char_index * freq_h / 5.0f + line_index * freq_v + (offx + 2.0f * rand_offset / (float)RAND_MAX) * M_PI;
+    return poll(&pollfd, 1, 0) == 0;
+}
 
-            pattern->get_color(&pattern->color_pattern, theta, &color);
-            wprintf(L"\033[38;2;%d;%d;%dm", color.red, color.green, color.blue);
+static int colorize_fd(queercat_t *queercat, output_buffer_t *output, int fd)
+{
+    static uint8_t buffer[INPUT_BUFFER_SIZE];
+
+    for (;;) {
+        /* Show what there is before waiting for more. */
+        if (output->flush_policy == FLUSH_POLICY_AUTO && output->length > 0 && input_idle(fd))
+            output_flush(output);
+
+        struct timespec start;
+        stats_start(&start);
+        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        stats_stop(&start, &stats.read_seconds);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (bytes_read == 0)
+            return 0;
+
+        stats_count_input(buffer, bytes_read, &stats.count_seconds);
+
+        if (colorize_buffer(queercat, output, buffer, bytes_read) < 0)
+            return -1;
+
+        if (output->flush_policy == FLUSH_POLICY_LINE)
+            output_flush_lines(output);
+    }
+}
+
+/* Like colorize_fd, with the reading done by a thread of its own. */
+static int colorize_fd_pipelined(queercat_t *queercat, output_buffer_t *output, int fd)
+{
+    stage_t *reader = start_stage(fd, INPUT_BUFFER_SIZE, reader_thread);
+    bool reader_done = false;
+    int status = 0;
+
+    for (;;) {
+        struct timespec start;
+        buffer_t buffer;
+
+        /* Show what there is before waiting for more. */
+        if (output->flush_policy == FLUSH_POLICY_AUTO && output->length > 0 && queue_empty(&reader->full))
+            output_flush(output);
+
+        stats_start(&start);
+        reader_done = !queue_pop(&reader->full, &buffer);
+        stats_stop(&start, &stats.wait_seconds);
+        if (reader_done)
             break;
 
-        case COLOR_TYPE_ANSII:
-            ncc = offx * pattern->ansii_pattern.codes_count + (int)(char_index * freq_h + line_index * freq_v);
-            if (cc != ncc)
-                wprintf(L"\033[38;5;%hhum", pattern->ansii_pattern.ansii_codes[(rand_offset + (cc = ncc)) % pattern->ansii_pattern.codes_count]);
+        stats_count_input(buffer.data, buffer.length, &stats.count_seconds);
+        status = colorize_buffer(queercat, output, buffer.data, buffer.length);
+        queue_push(&reader->free, buffer);
+        if (status < 0)
             break;
 
+        if (output->flush_policy == FLUSH_POLICY_LINE)
+            output_flush_lines(output);
+    }
+
+    int error = errno;
+    if (status == 0 && reader->error) {
+        error = reader->error;
+        status = -1;
+    }
+
+    /* After invalid input the reader may still be waiting on a pipe. The run stops
+     * there, so it is left to that. */
+    if (reader_done) {
+        pthread_join(reader->thread, NULL);
+        free(reader);
+    } else {
+        queue_close(&reader->free);
+        pthread_detach(reader->thread);
+    }
+
+    errno = error;
+    return status;
+}
+
+/* Maps a regular file for reading it front to back, when it is read from the
+ * start. Returns NULL if it cannot be mapped, in which case it is read with
+ * colorize_fd instead, from where it was left, as by a shell reading a line. */
+static const uint8_t *map_file(int fd, size_t *length)
+{
+    static bool handling_truncation = false;
+    struct stat st;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX
+            || lseek(fd, 0, SEEK_CUR) != 0)
+        return NULL;
+
+    /* Reading past the end of a file truncated under the mapping raises SIGBUS,
+     * in whichever thread does. */
+    if (!handling_truncation) {
+        struct sigaction action = { .sa_sigaction = fill_truncated_on_signal, .sa_flags = SA_SIGINFO };
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGBUS, &action, NULL))
+            return NULL;
+        page_size = sysconf(_SC_PAGESIZE);
+        handling_truncation = true;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    *length = st.st_size;
+    mapped_truncated = 0;
+    mapped_length = st.st_size;
+    mapped_data = data;
+    return data;
+}
+
+/* Unmaps a file mapped by map_file. Returns whether it was truncated while mapped. */
+static bool unmap_file(const uint8_t *data, size_t length)
+{
+    mapped_data = NULL;
+    munmap((void *)data, length);
+    return mapped_truncated;
+}
+
+/* Puts zeros in place of the pages of the mapped file that are gone, so that
+ * colorizing, on whichever thread, goes on to the end instead of being killed,
+ * and the truncation is reported after it. mmap is a plain system call, safe in
+ * a handler. Any other SIGBUS is fatal, as usual, once the handler returns. */
+static void fill_truncated_on_signal(int signal_number, siginfo_t *info, void *context)
+{
+    uintptr_t address = (uintptr_t)info->si_addr;
+    uintptr_t start = (uintptr_t)mapped_data;
+    uintptr_t end = start + mapped_length;
+
+    (void)context;
+    if (mapped_data != NULL && start <= address && address < end) {
+        uintptr_t page = address & ~(uintptr_t)(page_size - 1);
+        if (mmap((void *)page, end - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            mapped_truncated = 1;
+            return;
+        }
+    }
+
+    signal(signal_number, SIG_DFL);
+}
+
+/* Copies up to COPY_CHUNK_SIZE bytes in the kernel. Returns like read. */
+static ssize_t copy_chunk(copy_method_t method, int in_fd, int out_fd)
+{
+    switch (method) {
+        case COPY_METHOD_COPY_FILE_RANGE:
+            return copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+
+        case COPY_METHOD_SPLICE:
+            return splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+
+        case COPY_METHOD_SENDFILE:
+            return sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+
         default:
-            exit(1);
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/* Copies the rest of fd to the output as it is, for when there are no colors to
+ * add. Unlike colorizing, it does not check that the input is valid UTF-8. With
+ * the auto flush policy, and without stats to count the input, the kernel moves
+ * the bytes as they come. Otherwise they are read into the output buffer and
+ * written by the flush policy. Returns 0, or -1 with errno set on a read error.
+ * Write errors exit. */
+static int pass_through_fd(output_buffer_t *output, int fd)
+{
+    if (output->flush_policy == FLUSH_POLICY_AUTO && !stats.enabled) {
+        struct stat st;
+
+        /* Files that claim to be empty, like those in /proc, are only read. */
+        bool regular = !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0;
+
+        output_drain(output);
+        for (copy_method_t method = 0; method < COPY_METHOD_COUNT; method++) {
+            if (method != COPY_METHOD_SPLICE && !regular)
+                continue;
+
+            ssize_t copied;
+            do {
+                copied = copy_chunk(method, fd, output->fd);
+            } while (copied > 0 || (copied < 0 && errno == EINTR));
+
+            if (copied == 0)
+                return 0;
+
+            /* What the method cannot copy, the next one may. The bytes it did copy
+             * are behind the file offsets already. */
+            if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+                continue;
+
+            if (errno == EPIPE || errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+                write_error(errno);
+
+            /* The error may be the input's or the output's. The copy below reads
+             * and writes apart, and reports whichever it is. */
+            break;
+        }
+    }
+
+    for (;;) {
+        if (output->length == OUTPUT_BUFFER_SIZE)
+            output_flush(output);
+
+        /* Show what there is before waiting for more. */
+        if (output->flush_policy == FLUSH_POLICY_AUTO && output->length > 0 && input_idle(fd))
+            output_flush(output);
+
+        struct timespec start;
+        stats_start(&start);
+        ssize_t bytes_read = read(fd, output->data + output->length, OUTPUT_BUFFER_SIZE - output->length);
+        stats_stop(&start, &stats.read_seconds);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (bytes_read == 0)
+            return 0;
+
+        stats_count_input(output->data + output->length, bytes_read, &stats.count_seconds);
+        output->length += bytes_read;
+
+        if (output->flush_policy == FLUSH_POLICY_LINE)
+            output_flush_lines(output);
+    }
+}
+
+/* Used when the locale's encoding is not UTF-8. */
+static int colorize_stream(queercat_t *queercat, output_buffer_t *output, FILE *f)
+{
+    wint_t current_char;
+    mbstate_t state = { 0 };
+    char bytes[MB_LEN_MAX];
+
+    while ((current_char = fgetwc(f)) != WEOF) {
+        size_t length = wcrtomb(bytes, current_char, &state);
+        if (length == (size_t)-1)
+            length = 0;
+
+        if (stats.enabled) {
+            stats.input_bytes += length;
+            stats.input_chars++;
+        }
+
+        size_t written;
+        output_reserve(output);
+        queercat_colorize_char(queercat, current_char, bytes, length,
+                output->data + output->length, OUTPUT_BUFFER_SIZE - output->length, &written);
+        output->length += written;
+
+        /* Whether stdio has more input buffered is not known, so auto goes by lines too. */
+        if (current_char == '\n' && output->flush_policy != FLUSH_POLICY_BLOCK)
+            output_flush(output);
+    }
+
+    return ferror(f) ? -1 : 0;
+}
+
+/* Shows the cursor again, at exit or when interrupted. */
+static void show_cursor(void)
+{
+    if (write(STDOUT_FILENO, SHOW_CURSOR, strlen(SHOW_CURSOR)) < 0)
+        return;
+}
+
+static void show_cursor_on_signal(int signal_number)
+{
+    show_cursor();
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+/* A queercat_write_f writing each frame at its time, or right away when late. */
+static void animation_write(void *cookie, const void *data, size_t length)
+{
+    animation_t *animation = cookie;
+    struct timespec now;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &animation->next_frame, NULL) == EINTR)
+        ;
+
+    output_write(animation->output, data, length);
+    output_flush(animation->output);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > animation->next_frame.tv_sec
+            || (now.tv_sec == animation->next_frame.tv_sec && now.tv_nsec > animation->next_frame.tv_nsec))
+        animation->next_frame = now;
+
+    animation->next_frame.tv_nsec += animation->frame_nanoseconds;
+    animation->next_frame.tv_sec += animation->next_frame.tv_nsec / 1000000000;
+    animation->next_frame.tv_nsec %= 1000000000;
+}
+
+static int animate_line(queercat_t *queercat, animation_t *animation, const char *line, size_t length)
+{
+    int frames = queercat_animate_line(queercat, line, length, animation->frames, animation->columns,
+            animation_write, animation);
+
+    return (frames < 0) ? -1 : 0;
+}
+
+/* Animates the complete lines of data, keeping a partial last line for the next
+ * call. Returns 0, or -1 with errno set. */
+static int animate_lines(queercat_t *queercat, animation_t *animation, const char *data, size_t length)
+{
+    while (length > 0) {
+        const char *newline = memchr(data, '\n', length);
+        size_t line_length = (newline != NULL) ? (size_t)(newline + 1 - data) : length;
+
+        /* Lines that are whole in data are animated from there. */
+        if (newline != NULL && animation->line_length == 0) {
+            if (animate_line(queercat, animation, data, line_length) < 0)
+                return -1;
+        } else {
+            if (animation->line_length + line_length > animation->line_capacity) {
+                size_t capacity = 2 * animation->line_capacity + line_length;
+                char *line = realloc(animation->line, capacity);
+                if (line == NULL)
+                    err(2, NULL);
+                animation->line = line;
+                animation->line_capacity = capacity;
+            }
+            memcpy(animation->line + animation->line_length, data, line_length);
+            animation->line_length += line_length;
+
+            if (newline != NULL && animate_rest(queercat, animation) < 0)
+                return -1;
+        }
+
+        data += line_length;
+        length -= line_length;
+    }
+
+    return 0;
+}
+
+/* Animates what is kept of a line. */
+static int animate_rest(queercat_t *queercat, animation_t *animation)
+{
+    size_t length = animation->line_length;
+
+    animation->line_length = 0;
+    if (length == 0)
+        return 0;
+
+    return animate_line(queercat, animation, animation->line, length);
+}
+
+static int animate_fd(queercat_t *queercat, animation_t *animation, int fd)
+{
+    static char buffer[INPUT_BUFFER_SIZE];
+
+    for (;;) {
+        struct timespec start;
+        stats_start(&start);
+        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        stats_stop(&start, &stats.read_seconds);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (bytes_read == 0)
+            return animate_rest(queercat, animation);
+
+        stats_count_input(buffer, bytes_read, &stats.count_seconds);
+
+        if (animate_lines(queercat, animation, buffer, bytes_read) < 0)
+            return -1;
     }
 }
 
 int main(int argc, char** argv)
 {
     char* default_argv[] = { "-" };
-    int cc = -1;
     int i = 0;
-    int char_index = 0;
-    int line_index = 0;
-    wint_t current_char = '\0';
     bool print_colors = isatty(STDOUT_FILENO);
     bool force_locale = true;
     bool random = false;
-    color_type_t color_type = COLOR_TYPE_ANSII;
+    queercat_color_type_t color_type = QUEERCAT_COLOR_TYPE_ANSII;
     double freq_h = 0.23;
     double freq_v = 0.1;
     char* flag_type = "rainbow";
+    int jobs = 1;
+    int max_colors = 0;
+    int min_run = 0;
+    bool animate = false;
+    double fps = DEFAULT_ANIMATION_FPS;
+    int frames = DEFAULT_ANIMATION_FRAMES;
+    flush_policy_t flush_policy = FLUSH_POLICY_AUTO;
+    const char *flush_mode = NULL;
+    const char *serve_path = NULL;
+    const char *client_path = NULL;
+    const char *flag_files[argc];
+    int flag_files_count = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    stats.main_thread = pthread_self();
 
     struct timeval tv;
     gettimeofday(&tv, NULL);
     double offx = (tv.tv_sec % 300) / 300.0;
 
-    build_helpstr();
-
     /* Handle flags. */
     for (i = 1; i < argc; i++) {
         char* endptr;
@@ -616,6 +1087,12 @@ int main(int argc, char** argv)
             } else {
                 usage();
             }
+        } else if (!strcmp(argv[i], "--flag-file")) {
+            if ((++i) < argc) {
+                flag_files[flag_files_count++] = argv[i];
+            } else {
+                usage();
+            }
         } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--horizontal-frequency")) {
             if ((++i) < argc) {
                 freq_h = strtod(argv[i], &endptr);
@@ -647,7 +1124,81 @@ int main(int argc, char** argv)
         } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--random")) {
             random = true;
         } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--24bit")) {
-            color_type = COLOR_TYPE_24_BIT;
+            color_type = QUEERCAT_COLOR_TYPE_24_BIT;
+        } else if (!strcmp(argv[i], "--html")) {
+            /* HTML is meant for files, tty or not. */
+            color_type = QUEERCAT_COLOR_TYPE_HTML;
+            print_colors = true;
+        } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+            if ((++i) < argc) {
+                long value = strtol(argv[i], &endptr, 10);
+                if (*endptr || endptr == argv[i] || value < 1 || value > INT_MAX)
+                    usage();
+
+                /* More threads than cores only take turns. */
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                if (cores < 1)
+                    cores = 1;
+                jobs = (value > MAX_JOBS_PER_CORE * cores) ? MAX_JOBS_PER_CORE * cores : value;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--max-colors")) {
+            if ((++i) < argc) {
+                max_colors = strtol(argv[i], &endptr, 10);
+                if (*endptr || max_colors < 1)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--min-run")) {
+            if ((++i) < argc) {
+                min_run = strtol(argv[i], &endptr, 10);
+                if (*endptr || min_run < 1)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--animate")) {
+            animate = true;
+        } else if (!strcmp(argv[i], "--fps")) {
+            if ((++i) < argc) {
+                fps = strtod(argv[i], &endptr);
+                if (*endptr || !(fps > 0))
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--duration")) {
+            if ((++i) < argc) {
+                frames = strtol(argv[i], &endptr, 10);
+                if (*endptr || frames < 1)
+                    usage();
+            } else {
+                usage();
+            }
+        } else if (!strncmp(argv[i], "--flush=", strlen("--flush="))) {
+            flush_mode = argv[i] + strlen("--flush=");
+        } else if (!strcmp(argv[i], "--flush")) {
+            if ((++i) < argc) {
+                flush_mode = argv[i];
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--serve")) {
+            if ((++i) < argc) {
+                serve_path = argv[i];
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--client")) {
+            if ((++i) < argc) {
+                client_path = argv[i];
+            } else {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats.enabled = true;
         } else if (!strcmp(argv[i], "--version")) {
             version();
         } else {
@@ -657,8 +1208,32 @@ int main(int argc, char** argv)
         }
     }
 
+    /* Load the user's flags, then the ones asked for. */
+    if (load_user_flags() < 0)
+        exit(1);
+    for (int file = 0; file < flag_files_count; file++) {
+        if (load_flag_file(flag_files[file], false) < 0)
+            exit(1);
+    }
+
+    /* Run as a server, which gets its options from each client. */
+    if (serve_path != NULL)
+        return serve(serve_path);
+
+    /* Get flush policy. */
+    if (flush_mode != NULL) {
+        if (!strcmp(flush_mode, "auto"))
+            flush_policy = FLUSH_POLICY_AUTO;
+        else if (!strcmp(flush_mode, "line"))
+            flush_policy = FLUSH_POLICY_LINE;
+        else if (!strcmp(flush_mode, "block"))
+            flush_policy = FLUSH_POLICY_BLOCK;
+        else
+            usage();
+    }
+
     /* Get pattern. */
-    const pattern_t *pattern = lookup_pattern(flag_type);
+    const queercat_pattern_t *pattern = queercat_lookup_pattern(flag_type);
     if (pattern == NULL) {
         fprintf(stderr, "Invalid flag: %s\n", flag_type);
         exit(1);
@@ -689,75 +1264,176 @@ int main(int argc, char** argv)
         setlocale(LC_ALL, "");
     }
 
+    /* The help text is only formatted when asked for. */
+    for (char** filename = inputs; filename < inputs_end; filename++) {
+        if (!strcmp(*filename, "--help"))
+            build_helpstr();
+    }
+
+    /* Set up the colorizer. */
+    queercat_options_t options = {
+        .pattern = pattern,
+        .color_type = color_type,
+        .freq_h = freq_h,
+        .freq_v = freq_v,
+        .offx = offx,
+        .rand_offset = rand_offset,
+        .print_colors = print_colors,
+        .max_colors = max_colors,
+        .min_run = min_run
+    };
+
+    /* Leave the colorizing to a server. */
+    if (client_path != NULL)
+        return run_client(client_path, &options, inputs, inputs_end, helpstr);
+
+    /* Open the next files while reading the current one. */
+    prefetch_t *prefetch = prefetch_start(inputs, inputs_end);
+
+    static char output_data[OUTPUT_BUFFER_SIZE];
+    static output_buffer_t output = { .fd = STDOUT_FILENO, .data = output_data };
+    output.flush_policy = flush_policy;
+
+    /* With threads to spare, write while colorizing. */
+    if (jobs > 1) {
+        output.writer = start_stage(STDOUT_FILENO, OUTPUT_BUFFER_SIZE, writer_thread);
+        buffer_t buffer = { 0 };
+        queue_pop(&output.writer->free, &buffer);
+        output.data = buffer.data;
+    }
+    struct timespec setup_start;
+    stats_start(&setup_start);
+    queercat_t *queercat = queercat_create(&options);
+    if (queercat == NULL)
+        err(2, NULL);
+    stats_stop(&setup_start, &stats.setup_seconds);
+
+    if (stats.enabled) {
+        stats.queercat = queercat;
+        atexit(print_stats);
+    }
+
+    /* Decode UTF-8 ourselves unless the locale asks for another encoding. */
+    bool utf8_locale = !strcmp(nl_langinfo(CODESET), "UTF-8");
+
+    /* Animate line by line, with the cursor hidden while it moves around. */
+    static animation_t animation;
+    animate = animate && print_colors && utf8_locale && color_type != QUEERCAT_COLOR_TYPE_HTML;
+    if (animate) {
+        struct winsize winsize;
+
+        animation.output = &output;
+        animation.frames = frames;
+        animation.frame_nanoseconds = 1e9 / fps;
+        if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsize))
+            animation.columns = winsize.ws_col;
+
+        output_write(&output, HIDE_CURSOR, strlen(HIDE_CURSOR));
+        atexit(show_cursor);
+        signal(SIGINT, show_cursor_on_signal);
+        signal(SIGTERM, show_cursor_on_signal);
+    }
+
     /* For file in inputs. */
     for (char** filename = inputs; filename < inputs_end; filename++) {
-        wint_t (*this_file_read_wchar)(FILE*); /* Used for --help because fmemopen is universally broken when used with fgetwc */
-        FILE* f;
-        escape_state_t escape_state = ESCAPE_STATE_OUT;
+        int fd = -1;
+        FILE* f = NULL;
+        int status;
+        bool truncated = false;
 
         /* Handle "--help", "-" (STDIN) and file names. */
         if (!strcmp(*filename, "--help")) {
-            this_file_read_wchar = &helpstr_hack;
-            f = 0;
-
-        } else if (!strcmp(*filename, "-")) {
-            this_file_read_wchar = &fgetwc;
-            f = stdin;
-
-        } else {
-            this_file_read_wchar = &fgetwc;
-            f = fopen(*filename, "r");
-            if (!f) {
-                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *filename, strerror(errno));
-                return 2;
+            stats_count_input(helpstr, strlen(helpstr), &stats.count_seconds);
+            if (animate) {
+                status = animate_lines(queercat, &animation, helpstr, strlen(helpstr));
+                if (status == 0)
+                    status = animate_rest(queercat, &animation);
+            } else {
+                status = colorize_buffer(queercat, &output, helpstr, strlen(helpstr));
             }
-        }
-
-        /* While there are chars to read. */
-        while ((current_char = this_file_read_wchar(f)) != WEOF) {
 
-            /* If set to print colors, handle the colors. */
-            if (print_colors) {
-
-                /* Skip escape sequences. */
-                find_escape_sequences(current_char, &escape_state);
-                if (escape_state == ESCAPE_STATE_OUT) {
-
-                    /* Handle newlines. */
-                    if (current_char == '\n') {
-                        line_index++;
-                        char_index = 0;
-                    } else {
-                        char_index += wcwidth(current_char);
-                        print_color(pattern, color_type, char_index, line_index, freq_h, freq_v, offx, rand_offset, cc);
-                    }
+        } else {
+            if (!strcmp(*filename, "-")) {
+                fd = STDIN_FILENO;
+            } else {
+                fd = prefetch_open(prefetch, filename);
+                if (fd < 0) {
+                    output_drain(&output);
+                    fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *filename, strerror(errno));
+                    return 2;
                 }
             }
 
-            /* Print the char. */
-            putwchar(current_char);
+            const uint8_t *data = NULL;
+            size_t length;
+            if (utf8_locale && print_colors && !animate) {
+                struct timespec start;
+                stats_start(&start);
+                data = map_file(fd, &length);
+                stats_stop(&start, &stats.read_seconds);
+            }
 
-            if (escape_state == ESCAPE_STATE_LAST) {  /* implies "print_colors" */
-                print_color(pattern, color_type, char_index, line_index, freq_h, freq_v, offx, rand_offset, cc);
+            if (!print_colors) {
+                status = pass_through_fd(&output, fd);
+            } else if (animate) {
+                status = animate_fd(queercat, &animation, fd);
+            } else if (data != NULL) {
+                /* Counting is what pages the file in, which is its reading. */
+                stats_count_input(data, length, &stats.read_seconds);
+                if (print_colors && jobs > 1)
+                    status = queercat_colorize_parallel(queercat, data, length, jobs, output_write, &output);
+                else
+                    status = colorize_buffer(queercat, &output, data, length);
+                truncated = unmap_file(data, length);
+
+                /* Leave the file read, for whoever shares it. */
+                lseek(fd, length, SEEK_SET);
+            } else if (utf8_locale && jobs > 1) {
+                status = colorize_fd_pipelined(queercat, &output, fd);
+            } else if (utf8_locale) {
+                status = colorize_fd(queercat, &output, fd);
+            } else {
+                f = (fd == STDIN_FILENO) ? stdin : fdopen(fd, "r");
+                status = colorize_stream(queercat, &output, f);
             }
         }
+        int read_errno = errno;
+
+        /* Reset the colors. */
+        size_t written;
+        output_reserve(&output);
+        queercat_end_input(queercat, output.data + output.length, OUTPUT_BUFFER_SIZE - output.length, &written);
+        output.length += written;
+
+        if (fd >= 0) {
+            if (status < 0) {
+                output_drain(&output);
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *filename, strerror(read_errno));
+                f ? fclose(f) : close(fd);
+                return 2;
+            }
 
-        if (print_colors)
-            wprintf(L"\033[0m");
-
-        cc = -1;
-
-        if (f) {
-            if (ferror(f)) {
-                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *filename, strerror(errno));
-                fclose(f);
+            if (truncated) {
+                output_drain(&output);
+                fwprintf(stderr, L"Error reading input file \"%s\": truncated while reading it\n", *filename);
+                f ? fclose(f) : close(fd);
                 return 2;
             }
 
-            if (fclose(f)) {
+            if (fd != STDIN_FILENO && (f ? fclose(f) : close(fd))) {
+                output_drain(&output);
                 fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *filename, strerror(errno));
                 return 2;
             }
         }
     }
+
+    prefetch_stop(prefetch);
+    output_finish(&output);
+    if (stats.enabled) {
+        queercat_get_stats(queercat, &stats.counts);
+        stats.queercat = NULL;
+    }
+    queercat_destroy(queercat);
+    return 0;
 }
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "prefetch.h"
+
+
+/* *** Constants *****************************************************/
+/* Files opened ahead of the one being read. It bounds the open descriptors. */
+#define PREFETCH_FILES (8)
+
+
+/* *** Types *********************************************************/
+/* What opening an input gave. */
+typedef struct opened_file_s {
+    int fd;
+    int error;
+} opened_file_t;
+
+struct prefetch_s {
+    char **inputs;
+    int count;
+    opened_file_t *files;
+    int opened;   /* Inputs the thread is done with. */
+    int taken;    /* Inputs prefetch_open is done with. */
+    bool stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+};
+
+
+/* *** Functions Declarations ****************************************/
+static bool is_file(const char *input);
+static void *prefetch_thread(void *arg);
+
+
+/* *** Functions *****************************************************/
+static bool is_file(const char *input)
+{
+    return strcmp(input, "-") && strcmp(input, "--help");
+}
+
+static void *prefetch_thread(void *arg)
+{
+    prefetch_t *prefetch = arg;
+
+    for (int i = 0; i < prefetch->count; i++) {
+        pthread_mutex_lock(&prefetch->lock);
+        while (i - prefetch->taken >= PREFETCH_FILES && !prefetch->stopped)
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        bool stopped = prefetch->stopped;
+        pthread_mutex_unlock(&prefetch->lock);
+
+        if (stopped)
+            break;
+
+        opened_file_t file = { .fd = -1, .error = 0 };
+        if (is_file(prefetch->inputs[i])) {
+            file.fd = open(prefetch->inputs[i], O_RDONLY);
+            if (file.fd < 0)
+                file.error = errno;
+            else
+                posix_fadvise(file.fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->files[i] = file;
+        prefetch->opened = i + 1;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+    }
+
+    return NULL;
+}
+
+prefetch_t *prefetch_start(char **inputs, char **inputs_end)
+{
+    int files = 0;
+
+    for (char **input = inputs; input < inputs_end; input++)
+        files += is_file(*input);
+
+    /* The first file is opened right away either way. */
+    if (files < 2)
+        return NULL;
+
+    prefetch_t *prefetch = calloc(1, sizeof(*prefetch));
+    if (prefetch == NULL)
+        return NULL;
+
+    prefetch->inputs = inputs;
+    prefetch->count = inputs_end - inputs;
+    prefetch->files = calloc(prefetch->count, sizeof(*prefetch->files));
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+
+    if (prefetch->files == NULL || pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch)) {
+        free(prefetch->files);
+        free(prefetch);
+        return NULL;
+    }
+
+    return prefetch;
+}
+
+int prefetch_open(prefetch_t *prefetch, char **input)
+{
+    if (prefetch == NULL)
+        return open(*input, O_RDONLY);
+
+    int i = input - prefetch->inputs;
+
+    pthread_mutex_lock(&prefetch->lock);
+    while (prefetch->opened <= i)
+        pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+    opened_file_t file = prefetch->files[i];
+    prefetch->taken = i + 1;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    errno = file.error;
+    return file.fd;
+}
+
+void prefetch_stop(prefetch_t *prefetch)
+{
+    if (prefetch == NULL)
+        return;
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stopped = true;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->thread, NULL);
+
+    for (int i = prefetch->taken; i < prefetch->opened; i++) {
+        if (prefetch->files[i].fd >= 0)
+            close(prefetch->files[i].fd);
+    }
+
+    pthread_mutex_destroy(&prefetch->lock);
+    pthread_cond_destroy(&prefetch->changed);
+    free(prefetch->files);
+    free(prefetch);
+}
@@ -0,0 +1,22 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+/* *** Types *********************************************************/
+typedef struct prefetch_s prefetch_t;
+
+
+/* *** Functions *****************************************************/
+/* Opens the input files ahead of time on a thread of its own, a few at most
+ * ahead of the one being read, and has the kernel start reading them. "-" and
+ * "--help" are left alone. Returns NULL if there is no file after the first, or
+ * the thread cannot start, in which case prefetch_open opens files as usual. */
+prefetch_t *prefetch_start(char **inputs, char **inputs_end);
+
+/* Opens input, the next of the inputs in order, like open(*input, O_RDONLY).
+ * Returns the file descriptor, or -1 with errno set as open would. */
+int prefetch_open(prefetch_t *prefetch, char **input);
+
+/* Stops the thread and closes the files it opened that were not taken. */
+void prefetch_stop(prefetch_t *prefetch);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,2126 @@
+#define _XOPEN_SOURCE
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include "math.h"
+#include "queercat.h"
+#include "width_table.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+/* *** Common ********************************************************/
+/* Constants */
+#define NEWLINE '\n'
+#define ESCAPE_CHAR '\033'
+#define CANCEL_CHAR '\030'
+#define SUBSTITUTE_CHAR '\032'
+#define BELL_CHAR '\007'
+#define DELETE_CHAR '\177'
+
+/* Types */
+/* Where the input is within an ECMA-48 escape sequence. */
+typedef enum escape_state_e {
+    ESCAPE_STATE_OUT = 0,
+    ESCAPE_STATE_ESCAPE,        /* After ESC. */
+    ESCAPE_STATE_INTERMEDIATE,  /* ESC followed by intermediate bytes, as in charset selections. */
+    ESCAPE_STATE_CSI,           /* ESC [ */
+    ESCAPE_STATE_SINGLE_SHIFT,  /* ESC N (SS2) or ESC O (SS3), which take the next character along. */
+    ESCAPE_STATE_OSC,           /* ESC ], ended by ST or BEL. */
+    ESCAPE_STATE_STRING,        /* ESC P (DCS), ESC X (SOS), ESC ^ (PM) and ESC _ (APC), ended by ST. */
+    ESCAPE_STATE_STRING_ESCAPE, /* ESC within a string, the start of ST (ESC \\) or of a new sequence. */
+    ESCAPE_STATE_COUNT,
+    ESCAPE_STATE_NONE = ESCAPE_STATE_COUNT /* The character is not part of a sequence. */
+} escape_state_t;
+
+/* Macros */
+#define UNUSED(var) ((void)(var))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define NEXT_CYCLIC_ELEMENT(array, index, array_size) \
+    (((index) + 1 == (array_size)) ? (array)[0] : (array)[((index) + 1)] )
+#define ESCAPE_CLASS(c) ((c) < 0x80 ? (c) : 0x80)
+
+
+/* *** Constants *****************************************************/
+#define MAX_UTF8_SEQUENCE_LENGTH (6)
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+#define PARALLEL_OUTPUT_RESERVE (64 * 1024)
+#define MAX_COLOR_ESCAPE_LENGTH (sizeof("<span style=color:#rrggbb>") - 1)
+#define COLOR_ID_NONE (-1)
+#define RESET_ESCAPE "\033[0m"
+#define SPAN_CLOSE "</span>"
+
+/* Most a color change takes up in the output, which is in HTML, where the span of
+ * the previous color is closed first, and most a character does along with it, as
+ * its bytes or as an HTML entity. */
+#define MAX_COLOR_CHANGE_LENGTH (sizeof(SPAN_CLOSE) - 1 + MAX_COLOR_ESCAPE_LENGTH)
+#define MAX_CHAR_OUTPUT_LENGTH (MAX_COLOR_CHANGE_LENGTH + MAX_UTF8_SEQUENCE_LENGTH)
+#define PATTERN_SLOT_EMPTY (0)
+
+/* Columns whose colors are kept in a row when every line has the same colors.
+ * Characters past it get their colors computed. */
+#define COLUMN_ROW_SIZE (1024)
+#define MAX_CURSOR_MOVE_LENGTH (sizeof("\033[2147483647C") - 1)
+
+
+/* *** Types *********************************************************/
+/* Preformatted escape sequences, one per ANSI code or color table entry, each
+ * formatted the first time it is used, so that a short input pays only for the
+ * colors it shows. The color id is the ANSI code, or the 24-bit color. */
+typedef struct color_escape_s {
+    char bytes[MAX_COLOR_ESCAPE_LENGTH];
+    uint8_t length; /* 0 until formatted. */
+    int32_t color_id;
+} color_escape_t;
+typedef struct escape_table_s {
+    unsigned int count;
+    color_escape_t escapes[QUEERCAT_COLOR_TABLE_SIZE];
+} escape_table_t;
+
+/* Output, into a buffer owned by the caller. */
+typedef struct output_s {
+    char *data;
+    size_t length;
+    size_t capacity;
+} output_t;
+
+/* Colorizes a run of printable ASCII, in a variant specialized for the options. */
+typedef struct colorizer_s colorizer_t;
+typedef void(colorize_ascii_run_f)(colorizer_t *colorizer, const char *data, size_t length);
+
+/* Position along the colors, in 2^-32 of a period of them, so that it wraps
+ * around by itself. A period is 2 pi of theta in 24-bit mode, and all the codes
+ * of the pattern in ANSI mode. Each column adds a fixed step, rounded up, so the
+ * position drifts from the exact one by at most 2^-32 of a period per column. A
+ * 24-bit color can thus be one of the QUEERCAT_COLOR_TABLE_SIZE entries off, and an ANSI
+ * band start a column early, only where the exact position is that close to
+ * halfway between entries or to the edge of the band. A position right on a
+ * band edge, which -h 0.29 and the like land on every few lines, is in the band
+ * it starts; the float math this replaced often truncated it into the one
+ * before. */
+typedef uint32_t color_phase_t;
+
+/* Colorizer state, carried across input blocks and files. */
+struct colorizer_s {
+    const queercat_options_t *options;
+    escape_table_t *escape_table;
+    const uint16_t *column_row; /* Escape of each column, or NULL if lines differ. */
+    colorize_ascii_run_f *colorize_ascii_run;
+    int last_color_id; /* Color the terminal is known to be set to, or COLOR_ID_NONE. */
+    int run_length; /* Cells written in last_color_id so far. */
+    int char_index;
+    int line_index;
+    color_phase_t column_step;
+    color_phase_t line_start; /* Phase at the first column of line line_start_index. */
+    int line_start_index;     /* Or -1 before it is worked out. */
+    escape_state_t escape_state;
+    size_t escape_sequences; /* Counted as they start, which is rare next to characters. */
+    size_t color_escapes;
+    output_t *output;
+};
+
+struct queercat_s {
+    queercat_options_t options;
+    colorizer_t colorizer;
+    uint8_t pending[MAX_UTF8_SEQUENCE_LENGTH]; /* Start of a character split across inputs. */
+    size_t pending_length;
+    uint16_t column_row[COLUMN_ROW_SIZE];
+    escape_table_t escape_table;
+};
+
+/* Next escape state for each state and character, built once. Characters from
+ * 0x80 on share the 0x80 column. */
+typedef uint8_t escape_transitions_t[ESCAPE_STATE_COUNT][0x81];
+
+/* A newline-aligned piece of the input, colorized by a worker thread. */
+typedef struct parallel_chunk_s {
+    const uint8_t *data;
+    size_t length;
+    colorizer_t colorizer; /* State at the start of the chunk, and at its end once done. */
+    output_t output;
+    int status;
+    int error;
+    bool done;
+} parallel_chunk_t;
+
+/* Chunks are produced, colorized and written in order through a ring of slots. */
+typedef struct parallel_job_s {
+    parallel_chunk_t *chunks;
+    size_t window;
+    size_t produced;
+    size_t claimed;
+    bool finished;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} parallel_job_t;
+
+
+/* A character of an animated line, with the zero-width characters after it. */
+typedef struct animation_cell_s {
+    size_t offset;
+    size_t length;
+    int column;     /* Where it starts on the line. */
+    int char_index; /* Where it ends, which is what its color is for. */
+    const color_escape_t *escape; /* Its color in the frame being drawn. */
+    int shown_color_id;           /* Its color on the terminal. */
+} animation_cell_t;
+
+/* The terminal while an animated line is drawn. */
+typedef struct frame_state_s {
+    size_t cursor;       /* Cell the cursor is on, or the number of cells after the last one. */
+    int last_color_id;
+    size_t color_escapes;
+} frame_state_t;
+
+
+/* *** Flags *********************************************************/
+static const queercat_pattern_t flags[] = {
+    {
+        .name = "rainbow",
+        .ansii_pattern = {
+            .codes_count = 30,
+            .ansii_codes = { 39, 38, 44, 43, 49, 48, 84, 83, 119, 118, 154, 148, 184, 178,
+                214, 208, 209, 203, 204, 198, 199, 163, 164, 128, 129, 93, 99, 63, 69, 33 }
+        },
+        .color_pattern = { 0 },
+        .get_color = queercat_get_color_rainbow
+    },
+
+    {
+        .name = "transgender",
+        .ansii_pattern = {
+            .codes_count = 10,
+            .ansii_codes = {81, 81, 217, 217,  231, 231,  217, 217,  81, 81}
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0x55cdfc, /* #55cdfc - Blue */
+                0xf7a8b8, /* #f7a8b8 - Pink */
+                0xffffff, /* #ffffff - White */
+                0xf7a8b8, /* #f7a8b8 - Pink */
+                0x55cdfc  /* #55cdfc - Blue */
+            },
+            .factor = 4.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "nonbinary",
+        .ansii_pattern = {
+            .codes_count = 8,
+            .ansii_codes = {226, 226, 255, 255, 93, 93, 234, 234}
+        },
+        .color_pattern = {
+            .stripes_count = 4,
+            .stripes_colors = {
+                0xffff00, /* #ffff00 - Yellow */
+                0xb000ff, /* #b000ff - Purple */
+                0xffffff, /* #ffffff - White */
+                0x000000  /* #000000 - Black */
+            },
+            .factor = 4.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "lesbian",
+        .ansii_pattern = {
+            .codes_count = 5,
+            .ansii_codes = {196, 208, 255, 170, 128}
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0xff0000, /* #ff0000 - Red */
+                0xff993f, /* #ff993f - Orange */
+                0xffffff, /* #ffffff - White */
+                0xff8cbd, /* #ff8cbd - Pink */
+                0xff4284  /* #ff4284 - Purple */
+            },
+            .factor = 2.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "gay",
+        .ansii_pattern = {
+            .codes_count = 7,
+            .ansii_codes = {36, 49, 121, 255, 117, 105, 92}
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0x00b685, /* #00b685 - Teal */
+                0x6bffb6, /* #6bffb6 - Green */
+                0xffffff, /* #ffffff - White */
+                0x8be1ff, /* #8be1ff - Blue */
+                0x8e1ae1  /* #8e1ae1 - Purple */
+            },
+            .factor = 6.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "pansexual",
+        .ansii_pattern = {
+            .codes_count = 9,
+            .ansii_codes = {200, 200, 200,  227, 227, 227,  45, 45, 45}
+        },
+        .color_pattern = {
+            .stripes_count = 3,
+            .stripes_colors = {
+                0xff3388, /* #ff3388 - Pink */
+                0xffea00, /* #ffea00 - Yellow */
+                0x00dbff  /* #00dbff - Cyan */
+            },
+            .factor = 8.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "bisexual",
+        .ansii_pattern = {
+            .codes_count = 8,
+            .ansii_codes = {162, 162, 162,  129, 129, 27, 27, 27}
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0xff3b7b, /* #ff3b7b - Pink */
+                0xff3b7b, /* #ff3b7b - Pink */
+                0xd06bcc, /* #d06bcc - Purple */
+                0x3b72ff, /* #3b72ff - Blue */
+                0x3b72ff  /* #3b72ff - Blue */
+            },
+            .factor = 4.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "gender_fluid",
+        .ansii_pattern = {
+            .codes_count = 10,
+            .ansii_codes = {219, 219, 255, 255, 128, 128, 234, 234, 20, 20}
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0xffa0bc, /* #ffa0bc - Pink */
+                0xffffff, /* #ffffff - White */
+                0xc600e4, /* #c600e4 - Purple */
+                0x000000, /* #000000 - Black */
+                0x4e3cbb  /* #4e3cbb - Blue */
+            },
+            .factor = 2.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "asexual",
+        .ansii_pattern = {
+            .codes_count = 8,
+            .ansii_codes = {233, 233, 247, 247, 255, 255, 5, 5}
+        },
+        .color_pattern = {
+            .stripes_count = 4,
+            .stripes_colors = {
+                0x000000, /* #000000 - Black */
+                0xa3a3a3, /* #a3a3a3 - Gray */
+                0xffffff, /* #ffffff - White */
+                0x800080  /* #800080 - Purple */
+            },
+            .factor = 4.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "unlabeled",
+        .ansii_pattern = {
+            .codes_count = 8,
+            .ansii_codes = {194, 194, 255, 255, 195, 195, 223, 223}
+        },
+        .color_pattern = {
+            .stripes_count = 4,
+            .stripes_colors = {
+                0xe6f9e3, /* #e6f9e3 - Green */
+                0xfdfdfb, /* #fdfdfb - White */
+                0xdeeff9, /* #deeff9 - Blue */
+                0xfae1c2  /* #fae1c2 - Orange */
+            },
+            .factor = 4.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "aromantic",
+        .ansii_pattern = {
+            .codes_count = 10,
+            .ansii_codes = {
+                34, 34,
+                120, 120,
+                255, 255,
+                247, 247,
+                233, 233
+            }
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0x3da542, /* #3da542 - Green        */
+                0xa8d379, /* #a8d379 - Light green  */
+                0xffffff, /* #ffffff - White        */
+                0xa9a9a9, /* #a9a9a9 - Grey         */
+                0x000000  /* #000000 - Black        */
+            },
+            .factor = 1.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "aroace",
+        .ansii_pattern = {
+            .codes_count = 10,
+            .ansii_codes = {
+                208, 208,
+                220, 220,
+                255, 255,
+                75, 75,
+                62, 62
+            },
+        },
+        .color_pattern = {
+            .stripes_count = 5,
+            .stripes_colors = {
+                0xe28d00, /* #e28d00 - Orange     */
+                0xeccd00, /* #eccd00 - Yellow     */
+                0xffffff, /* #ffffff - White      */
+                0x62afdd, /* #62afdd - Light blue */
+                0x203756  /* #203756 - Blue       */
+            },
+            .factor = 1.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+
+    {
+        .name = "sapphic",
+        .ansii_pattern = {
+            .codes_count = 8,
+            .ansii_codes = {97, 97, 204, 204, 221, 221, 77, 77}
+        },
+        .color_pattern = {
+            .stripes_count = 4,
+            .stripes_colors = {
+                0x663399, /* #663399 - Purple */
+                0xff6699, /* #ff6699 - Pink */
+                0xffcc33, /* #ffcc33 - Yellow */
+                0x66cc33  /* #66cc33 - Green */
+            },
+            .factor = 1.0f
+        },
+        .get_color = queercat_get_color_stripes
+    },
+    /* Add new flags above this line. */
+};
+
+static const int FLAG_COUNT = sizeof(flags)/sizeof(flags[0]);
+
+/* Flags added at run time, numbered on from the built-in ones. */
+static const queercat_pattern_t **added_patterns;
+static int added_pattern_count;
+
+/* Open addressing index of the flag names. Slots hold a flag number plus one, or
+ * PATTERN_SLOT_EMPTY. */
+static uint32_t *pattern_index;
+static size_t pattern_index_mask;
+static pthread_once_t pattern_index_once = PTHREAD_ONCE_INIT;
+
+/* *** Escape Sequences **********************************************/
+static escape_transitions_t escape_transitions;
+static pthread_once_t escape_transitions_once = PTHREAD_ONCE_INIT;
+
+/* Control characters are carried out in the middle of sequences, except in strings. */
+static const bool escape_state_executes_controls[ESCAPE_STATE_COUNT] = {
+    [ESCAPE_STATE_ESCAPE] = true,
+    [ESCAPE_STATE_INTERMEDIATE] = true,
+    [ESCAPE_STATE_CSI] = true,
+    [ESCAPE_STATE_SINGLE_SHIFT] = true,
+    [ESCAPE_STATE_STRING_ESCAPE] = true
+};
+
+
+/* *** Functions Declarations ****************************************/
+/* Escape sequences */
+static void build_escape_transitions(void);
+static size_t skip_escape_sequence(const uint8_t *data, size_t length, escape_state_t *state, int *lines);
+
+/* Flags */
+static uint32_t hash_name(const char *name);
+static int find_pattern(const char *name);
+static int build_pattern_index(void);
+static void build_pattern_index_once(void);
+
+/* Output handling */
+static void output_write(output_t *output, const void *data, size_t length);
+static void output_write_escape(output_t *output, const color_escape_t *escape);
+static void output_write_color(output_t *output, const color_escape_t *escape, queercat_color_type_t color_type, int last_color_id);
+static int output_reserve(output_t *output, size_t length);
+
+/* Input handling */
+static int decode_utf8(const uint8_t *data, size_t length, wint_t *current_char);
+static int char_width(wint_t current_char);
+static void colorize_char(colorizer_t *colorizer, wint_t current_char, const char *bytes, size_t length);
+static void write_html_char(output_t *output, wint_t current_char, const char *bytes, size_t length);
+static void end_color(colorizer_t *colorizer);
+static size_t ascii_run_length(const uint8_t *data, size_t length, bool html);
+static void colorize_ascii_run(colorizer_t *colorizer, const char *data, size_t length,
+        bool print_colors, queercat_color_type_t color_type, bool keep_runs, bool by_column);
+static void link_colorizer(queercat_t *queercat);
+static int colorize_utf8(colorizer_t *colorizer, const uint8_t *data, size_t length, size_t *consumed);
+static int colorize_pending(queercat_t *queercat, const uint8_t *data, size_t length, size_t *consumed);
+
+/* Parallel colorization */
+static bool scan_lines(const uint8_t *data, size_t length, size_t target, size_t *position, escape_state_t *state, int *lines);
+static void colorize_chunk(parallel_chunk_t *chunk);
+static void *parallel_worker(void *arg);
+
+/* Animation */
+static int colorize_all(queercat_t *queercat, const uint8_t *data, size_t length, output_t *output);
+static size_t split_cells(const uint8_t *data, size_t length, animation_cell_t *cells, int *width);
+static void move_cursor(output_t *output, int from, int to);
+static size_t move_length(int from, int to);
+static int draw_frame(const uint8_t *data, const animation_cell_t *cells, size_t count, bool full,
+        frame_state_t *state, output_t *output);
+
+/* Colors handling */
+static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, queercat_color_t *output_color);
+static void color_at(const queercat_pattern_t *pattern, unsigned int index, queercat_color_t *color);
+static int build_escape_table(const queercat_options_t *options, escape_table_t *escape_table);
+static void format_escape(const queercat_options_t *options, escape_table_t *escape_table, unsigned int index);
+static const color_escape_t *table_escape(const queercat_options_t *options, escape_table_t *escape_table, unsigned long index);
+static color_phase_t phase_from_periods(double periods);
+static color_phase_t line_phase(colorizer_t *colorizer);
+static unsigned long color_index(const queercat_options_t *options, queercat_color_type_t color_type, color_phase_t phase);
+static const color_escape_t *current_escape(colorizer_t *colorizer);
+static void print_color(colorizer_t *colorizer, int width);
+
+/* *** Functions *****************************************************/
+/* Follows the ECMA-48 syntax the way VT-style terminals parse it: a sequence ends
+ * with its final byte, CAN or SUB cancel it, and ESC starts a new one anywhere. */
+static void build_escape_transitions(void)
+{
+    for (int state = 0; state < ESCAPE_STATE_COUNT; state++) {
+        for (int c = 0; c <= 0x80; c++) {
+            uint8_t next;
+
+            switch (state) {
+                case ESCAPE_STATE_OUT:
+                    next = ESCAPE_STATE_NONE;
+                    break;
+
+                case ESCAPE_STATE_ESCAPE:
+                case ESCAPE_STATE_STRING_ESCAPE:
+                    if (state == ESCAPE_STATE_STRING_ESCAPE && c == '\\')
+                        next = ESCAPE_STATE_OUT;
+                    else if (c == '[')
+                        next = ESCAPE_STATE_CSI;
+                    else if (c == ']')
+                        next = ESCAPE_STATE_OSC;
+                    else if (c == 'P' || c == 'X' || c == '^' || c == '_')
+                        next = ESCAPE_STATE_STRING;
+                    else if (c == 'N' || c == 'O')
+                        next = ESCAPE_STATE_SINGLE_SHIFT;
+                    else if (0x20 <= c && c <= 0x2f)
+                        next = ESCAPE_STATE_INTERMEDIATE;
+                    else if (0x30 <= c && c <= 0x7e)
+                        next = ESCAPE_STATE_OUT;
+                    else if (c < 0x20 || c == DELETE_CHAR)
+                        next = ESCAPE_STATE_ESCAPE;
+                    else
+                        next = ESCAPE_STATE_NONE;
+                    break;
+
+                case ESCAPE_STATE_INTERMEDIATE:
+                    if (c < 0x30 || c == DELETE_CHAR)
+                        next = ESCAPE_STATE_INTERMEDIATE;
+                    else if (c < 0x7f)
+                        next = ESCAPE_STATE_OUT;
+                    else
+                        next = ESCAPE_STATE_NONE;
+                    break;
+
+                case ESCAPE_STATE_CSI:
+                    if (c < 0x40 || c == DELETE_CHAR)
+                        next = ESCAPE_STATE_CSI;
+                    else if (c < 0x7f)
+                        next = ESCAPE_STATE_OUT;
+                    else
+                        next = ESCAPE_STATE_NONE;
+                    break;
+
+                case ESCAPE_STATE_SINGLE_SHIFT:
+                    next = (c < 0x20 || c == DELETE_CHAR) ? ESCAPE_STATE_SINGLE_SHIFT : ESCAPE_STATE_OUT;
+                    break;
+
+                case ESCAPE_STATE_OSC:
+                    next = (c == BELL_CHAR) ? ESCAPE_STATE_OUT : ESCAPE_STATE_OSC;
+                    break;
+
+                default:
+                    next = state;
+                    break;
+            }
+
+            /* Wherever they are, ESC starts over and CAN and SUB cancel. */
+            if (c == ESCAPE_CHAR)
+                next = (state == ESCAPE_STATE_OSC || state == ESCAPE_STATE_STRING) ? ESCAPE_STATE_STRING_ESCAPE : ESCAPE_STATE_ESCAPE;
+            else if ((c == CANCEL_CHAR || c == SUBSTITUTE_CHAR) && state != ESCAPE_STATE_OUT)
+                next = ESCAPE_STATE_OUT;
+
+            escape_transitions[state][c] = next;
+        }
+    }
+}
+
+/* Skips the ASCII bytes of the escape sequence data starts in, counting the
+ * newlines the terminal carries out along the way. Stops early at the first
+ * non-ASCII byte or at a byte that is not part of the sequence, either of which
+ * goes through colorize_char. Returns how many bytes were skipped. */
+static size_t skip_escape_sequence(const uint8_t *data, size_t length, escape_state_t *state, int *lines)
+{
+    escape_state_t current = *state;
+    size_t position = 0;
+
+    while (position < length && current != ESCAPE_STATE_OUT) {
+        uint8_t byte = data[position];
+        if (byte >= 0x80)
+            break;
+
+        uint8_t next = escape_transitions[current][byte];
+        if (next == ESCAPE_STATE_NONE)
+            break;
+
+        if (byte == NEWLINE && escape_state_executes_controls[current])
+            (*lines)++;
+
+        current = next;
+        position++;
+    }
+
+    *state = current;
+    return position;
+}
+
+/* FNV-1a. */
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *name; name++)
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+
+    return hash;
+}
+
+/* Returns the number of the flag called name, or -1. */
+static int find_pattern(const char *name)
+{
+    if (pattern_index == NULL)
+        return -1;
+
+    for (size_t slot = hash_name(name) & pattern_index_mask; pattern_index[slot] != PATTERN_SLOT_EMPTY;
+            slot = (slot + 1) & pattern_index_mask) {
+        int number = pattern_index[slot] - 1;
+        if (!strcmp(name, queercat_pattern(number)->name))
+            return number;
+    }
+
+    return -1;
+}
+
+/* Indexes every flag, in a table at most half full. Returns 0, or -1 with errno
+ * set to EEXIST if two flags have the same name, keeping the previous index. */
+static int build_pattern_index(void)
+{
+    int count = queercat_pattern_count();
+    size_t size = 16;
+
+    while (size < 2 * (size_t)count)
+        size *= 2;
+
+    uint32_t *index = calloc(size, sizeof(*index));
+    if (index == NULL)
+        return -1;
+
+    for (int number = 0; number < count; number++) {
+        const char *name = queercat_pattern(number)->name;
+        size_t slot = hash_name(name) & (size - 1);
+
+        for (; index[slot] != PATTERN_SLOT_EMPTY; slot = (slot + 1) & (size - 1)) {
+            if (!strcmp(name, queercat_pattern(index[slot] - 1)->name)) {
+                free(index);
+                errno = EEXIST;
+                return -1;
+            }
+        }
+        index[slot] = number + 1;
+    }
+
+    free(pattern_index);
+    pattern_index = index;
+    pattern_index_mask = size - 1;
+    return 0;
+}
+
+/* Without an index, lookups by name find nothing, as if out of memory. */
+static void build_pattern_index_once(void)
+{
+    if (pattern_index == NULL)
+        build_pattern_index();
+}
+
+/* returns NULL on failure */
+const queercat_pattern_t *queercat_lookup_pattern(const char *name)
+{
+    // check for name matches
+    pthread_once(&pattern_index_once, build_pattern_index_once);
+    int flag_num = find_pattern(name);
+    if (flag_num >= 0)
+        return queercat_pattern(flag_num);
+
+    // try number matches
+    char *endptr;
+    flag_num = (int)strtoul(name, &endptr, 10);
+
+    // left-over charaters, or number out of range
+    if(*endptr || (flag_num < 0 || flag_num >= queercat_pattern_count()))
+        return NULL;
+
+    return queercat_pattern(flag_num);
+}
+
+int queercat_add_patterns(const queercat_pattern_t *patterns, int count)
+{
+    pthread_once(&pattern_index_once, build_pattern_index_once);
+
+    const queercat_pattern_t **added = realloc(added_patterns, (added_pattern_count + count) * sizeof(*added));
+    if (added == NULL)
+        return -1;
+    added_patterns = added;
+
+    for (int i = 0; i < count; i++)
+        added[added_pattern_count + i] = &patterns[i];
+
+    added_pattern_count += count;
+    if (build_pattern_index() < 0) {
+        added_pattern_count -= count;
+        return -1;
+    }
+
+    return 0;
+}
+
+int queercat_pattern_count(void)
+{
+    return FLAG_COUNT + added_pattern_count;
+}
+
+const queercat_pattern_t *queercat_pattern(int number)
+{
+    if (number < 0 || number >= queercat_pattern_count())
+        return NULL;
+
+    return (number < FLAG_COUNT) ? &flags[number] : added_patterns[number - FLAG_COUNT];
+}
+
+/* Returns -1 for a pattern that is not a flag. */
+int queercat_pattern_number(const queercat_pattern_t *pattern)
+{
+    if (pattern >= flags && pattern < flags + FLAG_COUNT)
+        return pattern - flags;
+
+    for (int i = 0; i < added_pattern_count; i++) {
+        if (added_patterns[i] == pattern)
+            return FLAG_COUNT + i;
+    }
+
+    return -1;
+}
+
+queercat_t *queercat_create(const queercat_options_t *options)
+{
+    if (options->pattern == NULL || options->color_type <= QUEERCAT_COLOR_TYPE_INVALID || options->color_type >= QUEERCAT_COLOR_TYPE_COUNT
+            || options->pattern->ansii_pattern.codes_count == 0
+            || options->pattern->ansii_pattern.codes_count > QUEERCAT_MAX_ANSII_CODES_COUNT
+            || options->pattern->color_pattern.stripes_count > QUEERCAT_MAX_FLAG_STRIPES) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    queercat_t *queercat = malloc(sizeof(*queercat));
+    if (queercat == NULL)
+        return NULL;
+
+    pthread_once(&escape_transitions_once, build_escape_transitions);
+
+    queercat->options = *options;
+
+    /* Size the table of color escapes, which fills as it is used. */
+    if (options->print_colors && build_escape_table(options, &queercat->escape_table) < 0) {
+        free(queercat);
+        return NULL;
+    }
+
+    link_colorizer(queercat);
+    queercat_reset(queercat);
+    return queercat;
+}
+
+queercat_t *queercat_copy(const queercat_t *base, const queercat_options_t *options)
+{
+    if (options->pattern != base->options.pattern || options->color_type != base->options.color_type
+            || options->print_colors != base->options.print_colors || options->max_colors != base->options.max_colors)
+        return queercat_create(options);
+
+    queercat_t *queercat = malloc(sizeof(*queercat));
+    if (queercat == NULL)
+        return NULL;
+
+    /* Only the escapes in use, which are few in ANSI mode. */
+    size_t escapes_count = base->options.print_colors ? base->escape_table.count : 0;
+    memcpy(queercat, base, offsetof(queercat_t, escape_table.escapes) + escapes_count * sizeof(color_escape_t));
+    queercat->options = *options;
+
+    link_colorizer(queercat);
+    queercat_reset(queercat);
+    return queercat;
+}
+
+void queercat_destroy(queercat_t *queercat)
+{
+    free(queercat);
+}
+
+void queercat_reset(queercat_t *queercat)
+{
+    queercat->colorizer.last_color_id = COLOR_ID_NONE;
+    queercat->colorizer.run_length = 0;
+    queercat->colorizer.char_index = 0;
+    queercat->colorizer.line_index = 0;
+    queercat->colorizer.escape_state = ESCAPE_STATE_OUT;
+    queercat->colorizer.escape_sequences = 0;
+    queercat->colorizer.color_escapes = 0;
+    queercat->pending_length = 0;
+}
+
+void queercat_get_stats(const queercat_t *queercat, queercat_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->colorized_escape_sequences = queercat->colorizer.escape_sequences;
+    stats->color_escapes[queercat->options.color_type] = queercat->colorizer.color_escapes;
+}
+
+int queercat_colorize(queercat_t *queercat, const void *input, size_t input_length, size_t *input_consumed,
+        void *output, size_t output_size, size_t *output_written)
+{
+    output_t sink = { .data = output, .length = 0, .capacity = output_size };
+    size_t consumed = 0;
+    size_t position = 0;
+    int status = 0;
+
+    *input_consumed = 0;
+    *output_written = 0;
+    if (output_size < QUEERCAT_MIN_OUTPUT_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    queercat->colorizer.output = &sink;
+
+    /* Finish the character the previous input ended in. */
+    if (queercat->pending_length > 0)
+        status = colorize_pending(queercat, input, input_length, &position);
+
+    if (status == 0 && queercat->pending_length == 0) {
+        status = colorize_utf8(&queercat->colorizer, (const uint8_t *)input + position, input_length - position, &consumed);
+        position += consumed;
+
+        /* Keep an incomplete character at the end for the next input. */
+        if (status == 0) {
+            queercat->pending_length = input_length - position;
+            memcpy(queercat->pending, (const uint8_t *)input + position, queercat->pending_length);
+            position = input_length;
+        }
+    }
+
+    queercat->colorizer.output = NULL;
+    *input_consumed = position;
+    *output_written = sink.length;
+    return (status < 0) ? -1 : 0;
+}
+
+int queercat_colorize_char(queercat_t *queercat, uint32_t current_char, const char *bytes, size_t length,
+        void *output, size_t output_size, size_t *output_written)
+{
+    output_t sink = { .data = output, .length = 0, .capacity = output_size };
+
+    *output_written = 0;
+    if (output_size < QUEERCAT_MIN_OUTPUT_SIZE || length > QUEERCAT_MIN_OUTPUT_SIZE - MAX_COLOR_CHANGE_LENGTH) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Work the color out from the line and column, without the column row. */
+    const uint16_t *column_row = queercat->colorizer.column_row;
+    queercat->colorizer.column_row = NULL;
+
+    queercat->colorizer.output = &sink;
+    colorize_char(&queercat->colorizer, current_char, bytes, length);
+    queercat->colorizer.output = NULL;
+    queercat->colorizer.column_row = column_row;
+
+    *output_written = sink.length;
+    return 0;
+}
+
+int queercat_end_input(queercat_t *queercat, void *output, size_t output_size, size_t *output_written)
+{
+    *output_written = 0;
+    if (output_size < QUEERCAT_MIN_OUTPUT_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Like fgetwc, drop an incomplete sequence at the end of the input. */
+    queercat->pending_length = 0;
+
+    if (queercat->options.print_colors && queercat->options.color_type == QUEERCAT_COLOR_TYPE_HTML) {
+        output_t sink = { .data = output, .length = 0, .capacity = output_size };
+        queercat->colorizer.output = &sink;
+        end_color(&queercat->colorizer);
+        queercat->colorizer.output = NULL;
+        *output_written = sink.length;
+    } else if (queercat->options.print_colors) {
+        memcpy(output, RESET_ESCAPE, strlen(RESET_ESCAPE));
+        *output_written = strlen(RESET_ESCAPE);
+    }
+
+    queercat->colorizer.escape_state = ESCAPE_STATE_OUT;
+    queercat->colorizer.last_color_id = COLOR_ID_NONE;
+    return 0;
+}
+
+/* The caller makes sure there is room. */
+static void output_write(output_t *output, const void *data, size_t length)
+{
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+/* Copies the whole fixed-size slot and keeps only the escape's length of it. */
+static void output_write_escape(output_t *output, const color_escape_t *escape)
+{
+    memcpy(output->data + output->length, escape->bytes, sizeof(escape->bytes));
+    output->length += escape->length;
+}
+
+/* Switches to the color of escape. In HTML that ends the span of the previous
+ * color first, if there is one. */
+static inline void output_write_color(output_t *output, const color_escape_t *escape, queercat_color_type_t color_type, int last_color_id)
+{
+    if (color_type == QUEERCAT_COLOR_TYPE_HTML && last_color_id != COLOR_ID_NONE)
+        output_write(output, SPAN_CLOSE, strlen(SPAN_CLOSE));
+    output_write_escape(output, escape);
+}
+
+/* Grows an allocated output so that at least length more bytes fit. */
+static int output_reserve(output_t *output, size_t length)
+{
+    if (output->capacity - output->length >= length)
+        return 0;
+
+    size_t capacity = 2 * output->capacity;
+    if (capacity < output->length + length)
+        capacity = output->length + length;
+
+    char *data = realloc(output->data, capacity);
+    if (data == NULL)
+        return -1;
+
+    output->data = data;
+    output->capacity = capacity;
+    return 0;
+}
+
+/* Decodes one character the way glibc's UTF-8 locales do, historical 5 and 6 byte
+ * forms included. Returns the sequence length, 0 if the sequence is cut short by
+ * the end of the data and -1 if it is invalid. */
+static int decode_utf8(const uint8_t *data, size_t length, wint_t *current_char)
+{
+    uint8_t lead = data[0];
+    int sequence_length;
+    wint_t min_char;
+    wint_t c;
+
+    if (lead < 0x80) {
+        *current_char = lead;
+        return 1;
+    } else if (lead < 0xc2) {
+        return -1;
+    } else if (lead < 0xe0) {
+        sequence_length = 2;
+        min_char = 0x80;
+        c = lead & 0x1f;
+    } else if (lead < 0xf0) {
+        sequence_length = 3;
+        min_char = 0x800;
+        c = lead & 0x0f;
+    } else if (lead < 0xf8) {
+        sequence_length = 4;
+        min_char = 0x10000;
+        c = lead & 0x07;
+    } else if (lead < 0xfc) {
+        sequence_length = 5;
+        min_char = 0x200000;
+        c = lead & 0x03;
+    } else if (lead < 0xfe) {
+        sequence_length = 6;
+        min_char = 0x4000000;
+        c = lead & 0x01;
+    } else {
+        return -1;
+    }
+
+    for (int i = 1; i < sequence_length; i++) {
+        if ((size_t)i >= length)
+            return 0;
+        if ((data[i] & 0xc0) != 0x80)
+            return -1;
+        c = (c << 6) | (data[i] & 0x3f);
+    }
+
+    /* Overlong forms and UTF-16 surrogates. */
+    if (c < min_char || (0xd800 <= c && c <= 0xdfff))
+        return -1;
+
+    *current_char = c;
+    return sequence_length;
+}
+
+/* Returns how many columns a character takes up, from the table generated out of
+ * unicode/width.txt. Unlike wcwidth, it does not depend on the locale and is 0
+ * rather than -1 for control characters. */
+static inline int char_width(wint_t current_char)
+{
+    if (current_char >= WIDTH_TABLE_CHARS)
+        return 1;
+
+    const uint8_t *block = width_stage2[width_stage1[current_char >> WIDTH_TABLE_BLOCK_BITS]];
+    unsigned int offset = current_char & ((1 << WIDTH_TABLE_BLOCK_BITS) - 1);
+
+    return (block[offset / 4] >> (2 * (offset % 4))) & 3;
+}
+
+static void colorize_char(colorizer_t *colorizer, wint_t current_char, const char *bytes, size_t length)
+{
+    /* If set to print colors, handle the colors. */
+    if (colorizer->options->print_colors) {
+        bool html = colorizer->options->color_type == QUEERCAT_COLOR_TYPE_HTML;
+        escape_state_t state = colorizer->escape_state;
+        uint8_t next = escape_transitions[state][ESCAPE_CLASS(current_char)];
+
+        if (next != ESCAPE_STATE_NONE) {
+            bool newline = current_char == '\n' && escape_state_executes_controls[state];
+
+            /* Part of an escape sequence. It may change the color, so restate it after. */
+            if (state == ESCAPE_STATE_OUT)
+                colorizer->escape_sequences++;
+            colorizer->escape_state = next;
+            if (newline) {
+                colorizer->line_index++;
+                colorizer->char_index = 0;
+            }
+
+            /* HTML has no use for it, so only a newline it carries out is kept. */
+            if (html) {
+                if (newline) {
+                    end_color(colorizer);
+                    output_write(colorizer->output, bytes, length);
+                }
+                return;
+            }
+            colorizer->last_color_id = COLOR_ID_NONE;
+
+        } else {
+            colorizer->escape_state = ESCAPE_STATE_OUT;
+
+            /* Handle newlines. Every line states its first color again. */
+            if (current_char == '\n') {
+                colorizer->line_index++;
+                colorizer->char_index = 0;
+                end_color(colorizer);
+            } else {
+                int width = char_width(current_char);
+                colorizer->char_index += width;
+                print_color(colorizer, width);
+            }
+
+            if (html) {
+                write_html_char(colorizer->output, current_char, bytes, length);
+                return;
+            }
+        }
+    }
+
+    /* Print the char. */
+    output_write(colorizer->output, bytes, length);
+}
+
+/* Writes a character as HTML text, with the characters that have a meaning in
+ * markup as entities, and the controls but newlines and tabs as character
+ * references, which are no longer than the character may be. */
+static void write_html_char(output_t *output, wint_t current_char, const char *bytes, size_t length)
+{
+    char reference[sizeof("&#xNN;")];
+
+    switch (current_char) {
+        case '<':
+            output_write(output, "&lt;", strlen("&lt;"));
+            break;
+
+        case '>':
+            output_write(output, "&gt;", strlen("&gt;"));
+            break;
+
+        case '&':
+            output_write(output, "&amp;", strlen("&amp;"));
+            break;
+
+        case '\n':
+        case '\t':
+            output_write(output, bytes, length);
+            break;
+
+        default:
+            if (current_char < 0x20 || (0x7f <= current_char && current_char < 0xa0))
+                output_write(output, reference, snprintf(reference, sizeof(reference), "&#x%02x;", (unsigned)current_char));
+            else
+                output_write(output, bytes, length);
+            break;
+    }
+}
+
+/* Forgets the color at the end of a line or input, so that the next character
+ * states its own. In HTML that closes the span, which never goes past a line. */
+static void end_color(colorizer_t *colorizer)
+{
+    if (colorizer->options->color_type == QUEERCAT_COLOR_TYPE_HTML && colorizer->last_color_id != COLOR_ID_NONE)
+        output_write(colorizer->output, SPAN_CLOSE, strlen(SPAN_CLOSE));
+    colorizer->last_color_id = COLOR_ID_NONE;
+}
+
+/* Returns how many bytes at the start of data are printable ASCII. None of those
+ * can start or end an escape sequence, and each is one column wide. For HTML the
+ * run stops at the characters written as entities. */
+static inline size_t ascii_run_length(const uint8_t *data, size_t length, bool html)
+{
+    size_t run = 0;
+
+#if defined(__AVX2__)
+    const __m256i below = _mm256_set1_epi8(0x20 - 1);
+    const __m256i above = _mm256_set1_epi8(0x7f);
+    for (; run + 32 <= length; run += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + run));
+        __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, below), _mm256_cmpgt_epi8(above, bytes));
+        if (html) {
+            __m256i markup = _mm256_or_si256(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('<')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('>'))),
+                    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('&')));
+            printable = _mm256_andnot_si256(markup, printable);
+        }
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(printable);
+        if (mask)
+            return run + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    /* Bytes from 0x80 on are negative as signed chars, so two signed compares do. */
+    const __m128i below = _mm_set1_epi8(0x20 - 1);
+    const __m128i above = _mm_set1_epi8(0x7f);
+    for (; run + 16 <= length; run += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + run));
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, below), _mm_cmplt_epi8(bytes, above));
+        if (html) {
+            __m128i markup = _mm_or_si128(_mm_or_si128(
+                    _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>'))),
+                    _mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')));
+            printable = _mm_andnot_si128(markup, printable);
+        }
+        uint32_t mask = ~(uint32_t)_mm_movemask_epi8(printable) & 0xffff;
+        if (mask)
+            return run + __builtin_ctz(mask);
+    }
+#endif
+
+    while (run < length && 0x20 <= data[run] && data[run] < 0x7f
+            && !(html && (data[run] == '<' || data[run] == '>' || data[run] == '&')))
+        run++;
+
+    return run;
+}
+
+/* Colorizes a run of printable ASCII. Only the color boundaries inside the run
+ * need an escape; the text between them is copied in one piece. Always inlined
+ * with constant options by DEFINE_ASCII_RUN, so that each variant's loop has no
+ * branches on them. */
+static inline __attribute__((always_inline)) void colorize_ascii_run(colorizer_t *colorizer, const char *data, size_t length,
+        bool print_colors, queercat_color_type_t color_type, bool keep_runs, bool by_column)
+{
+    size_t start = 0;
+
+    if (print_colors) {
+        const queercat_options_t *options = colorizer->options;
+        escape_table_t *escape_table = colorizer->escape_table;
+        const uint16_t *column_row = colorizer->column_row;
+        int min_run = options->min_run;
+        int run_length = colorizer->run_length;
+        int char_index = colorizer->char_index;
+        int last_color_id = colorizer->last_color_id;
+        color_phase_t column_step = colorizer->column_step;
+        color_phase_t phase = line_phase(colorizer) + (color_phase_t)char_index * column_step;
+
+        for (size_t i = 0; i < length; i++) {
+            char_index++;
+            phase += column_step;
+
+            const color_escape_t *escape = table_escape(options, escape_table, (by_column && char_index < COLUMN_ROW_SIZE)
+                ? column_row[char_index]
+                : color_index(options, color_type, phase));
+            if (escape->color_id != last_color_id
+                    && (!keep_runs || run_length >= min_run || last_color_id == COLOR_ID_NONE)) {
+                output_write(colorizer->output, data + start, i - start);
+                output_write_color(colorizer->output, escape, color_type, last_color_id);
+                last_color_id = escape->color_id;
+                colorizer->color_escapes++;
+                run_length = 0;
+                start = i;
+            }
+            run_length++;
+        }
+
+        colorizer->char_index = char_index;
+        colorizer->last_color_id = last_color_id;
+        colorizer->run_length = run_length;
+    }
+
+    output_write(colorizer->output, data + start, length - start);
+}
+
+#define DEFINE_ASCII_RUN(name, print_colors, color_type, keep_runs, by_column) \
+    static void name(colorizer_t *colorizer, const char *data, size_t length) \
+    { \
+        colorize_ascii_run(colorizer, data, length, print_colors, color_type, keep_runs, by_column); \
+    }
+
+DEFINE_ASCII_RUN(colorize_ascii_run_plain, false, QUEERCAT_COLOR_TYPE_ANSII, false, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_ansi, true, QUEERCAT_COLOR_TYPE_ANSII, false, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_ansi_runs, true, QUEERCAT_COLOR_TYPE_ANSII, true, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_ansi_columns, true, QUEERCAT_COLOR_TYPE_ANSII, false, true)
+DEFINE_ASCII_RUN(colorize_ascii_run_ansi_columns_runs, true, QUEERCAT_COLOR_TYPE_ANSII, true, true)
+DEFINE_ASCII_RUN(colorize_ascii_run_24_bit, true, QUEERCAT_COLOR_TYPE_24_BIT, false, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_24_bit_runs, true, QUEERCAT_COLOR_TYPE_24_BIT, true, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_24_bit_columns, true, QUEERCAT_COLOR_TYPE_24_BIT, false, true)
+DEFINE_ASCII_RUN(colorize_ascii_run_24_bit_columns_runs, true, QUEERCAT_COLOR_TYPE_24_BIT, true, true)
+DEFINE_ASCII_RUN(colorize_ascii_run_html, true, QUEERCAT_COLOR_TYPE_HTML, false, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_html_runs, true, QUEERCAT_COLOR_TYPE_HTML, true, false)
+DEFINE_ASCII_RUN(colorize_ascii_run_html_columns, true, QUEERCAT_COLOR_TYPE_HTML, false, true)
+DEFINE_ASCII_RUN(colorize_ascii_run_html_columns_runs, true, QUEERCAT_COLOR_TYPE_HTML, true, true)
+
+/* Variants by color type, by whether there is a column row and by whether
+ * min_run is set. */
+static colorize_ascii_run_f *const ascii_run_variants[QUEERCAT_COLOR_TYPE_COUNT][2][2] = {
+    [QUEERCAT_COLOR_TYPE_ANSII] = {
+        { colorize_ascii_run_ansi, colorize_ascii_run_ansi_runs },
+        { colorize_ascii_run_ansi_columns, colorize_ascii_run_ansi_columns_runs }
+    },
+    [QUEERCAT_COLOR_TYPE_24_BIT] = {
+        { colorize_ascii_run_24_bit, colorize_ascii_run_24_bit_runs },
+        { colorize_ascii_run_24_bit_columns, colorize_ascii_run_24_bit_columns_runs }
+    },
+    [QUEERCAT_COLOR_TYPE_HTML] = {
+        { colorize_ascii_run_html, colorize_ascii_run_html_runs },
+        { colorize_ascii_run_html_columns, colorize_ascii_run_html_columns_runs }
+    }
+};
+
+/* Points the colorizer at the rest of the context, and picks what it colorizes
+ * with. Without a vertical frequency every line has the same colors, so they are
+ * computed once for the first columns, and looked up by column from then on. */
+static void link_colorizer(queercat_t *queercat)
+{
+    const queercat_options_t *options = &queercat->options;
+    colorizer_t *colorizer = &queercat->colorizer;
+
+    colorizer->options = options;
+    colorizer->escape_table = &queercat->escape_table;
+    colorizer->column_row = NULL;
+    colorizer->line_start_index = -1;
+
+    switch (options->color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            colorizer->column_step = phase_from_periods(options->freq_h / 5.0 / (2.0 * M_PI));
+            break;
+
+        case QUEERCAT_COLOR_TYPE_ANSII:
+            colorizer->column_step = phase_from_periods(options->freq_h / options->pattern->ansii_pattern.codes_count);
+            break;
+
+        default:
+            break;
+    }
+
+    if (!options->print_colors) {
+        colorizer->colorize_ascii_run = colorize_ascii_run_plain;
+        return;
+    }
+
+    if (options->freq_v == 0) {
+        colorizer->line_index = 0;
+        color_phase_t phase = line_phase(colorizer);
+        for (int column = 0; column < COLUMN_ROW_SIZE; column++, phase += colorizer->column_step)
+            queercat->column_row[column] = color_index(options, options->color_type, phase);
+        colorizer->column_row = queercat->column_row;
+    }
+
+    colorizer->colorize_ascii_run = ascii_run_variants[options->color_type][colorizer->column_row != NULL][options->min_run > 0];
+}
+
+/* Colorizes the complete characters in data for as long as the output has room
+ * for them. An incomplete sequence at the end is left unconsumed. Returns 0 once
+ * done, 1 if the output is full and -1 with errno set on invalid input. */
+static int colorize_utf8(colorizer_t *colorizer, const uint8_t *data, size_t length, size_t *consumed)
+{
+    output_t *output = colorizer->output;
+    size_t char_cost = colorizer->options->print_colors ? MAX_COLOR_CHANGE_LENGTH + 1 : 1;
+    bool html = colorizer->options->print_colors && colorizer->options->color_type == QUEERCAT_COLOR_TYPE_HTML;
+    size_t position = 0;
+
+    while (position < length) {
+        size_t space = output->capacity - output->length;
+
+        /* Outside escape sequences, take printable ASCII a run at a time, as much
+         * of it as fits even if every character changes the color. */
+        if (colorizer->escape_state == ESCAPE_STATE_OUT) {
+            size_t run = ascii_run_length(data + position, MIN(length - position, space / char_cost), html);
+            if (run > 0) {
+                colorizer->colorize_ascii_run(colorizer, (const char *)data + position, run);
+                position += run;
+                continue;
+            }
+
+        /* Inside them, copy the whole sequence. HTML leaves it out but for the
+         * newlines it carries out, which take no more room than it does. */
+        } else {
+            int lines = 0;
+            size_t room = html ? space - MIN(space, strlen(SPAN_CLOSE)) : space;
+            size_t skipped = skip_escape_sequence(data + position, MIN(length - position, room), &colorizer->escape_state, &lines);
+            if (skipped > 0) {
+                if (lines > 0) {
+                    colorizer->line_index += lines;
+                    colorizer->char_index = 0;
+                }
+                if (!html) {
+                    output_write(colorizer->output, data + position, skipped);
+                } else if (lines > 0) {
+                    end_color(colorizer);
+                    memset(output->data + output->length, NEWLINE, lines);
+                    output->length += lines;
+                }
+                position += skipped;
+                continue;
+            }
+        }
+
+        wint_t current_char;
+        int sequence_length = decode_utf8(data + position, length - position, &current_char);
+
+        if (sequence_length == 0)
+            break;
+
+        if (sequence_length < 0) {
+            *consumed = position;
+            errno = EILSEQ;
+            return -1;
+        }
+
+        if (space < MAX_CHAR_OUTPUT_LENGTH) {
+            *consumed = position;
+            return 1;
+        }
+
+        colorize_char(colorizer, current_char, (const char *)data + position, sequence_length);
+        position += sequence_length;
+    }
+
+    *consumed = position;
+    return 0;
+}
+
+/* Completes the pending character with the start of data. Returns like
+ * colorize_utf8, with *consumed counting only bytes of data. */
+static int colorize_pending(queercat_t *queercat, const uint8_t *data, size_t length, size_t *consumed)
+{
+    output_t *output = queercat->colorizer.output;
+    uint8_t bytes[MAX_UTF8_SEQUENCE_LENGTH];
+    size_t pending_length = queercat->pending_length;
+    size_t taken = MIN(length, sizeof(bytes) - pending_length);
+    wint_t current_char;
+
+    memcpy(bytes, queercat->pending, pending_length);
+    memcpy(bytes + pending_length, data, taken);
+
+    *consumed = 0;
+    int sequence_length = decode_utf8(bytes, pending_length + taken, &current_char);
+
+    if (sequence_length == 0) {
+        /* Still incomplete, so all of data fits in the pending bytes. */
+        memcpy(queercat->pending, bytes, pending_length + taken);
+        queercat->pending_length += taken;
+        *consumed = taken;
+        return 0;
+    }
+
+    if (sequence_length < 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    if (output->capacity - output->length < MAX_CHAR_OUTPUT_LENGTH)
+        return 1;
+
+    colorize_char(&queercat->colorizer, current_char, (const char *)bytes, sequence_length);
+    queercat->pending_length = 0;
+    *consumed = sequence_length - pending_length;
+    return 0;
+}
+
+/* Counts the newlines the colorizer will see in data from *position on, starting
+ * in escape state *state. Stops right after the first one at or past target and
+ * returns true, or returns false at the end of the data. */
+static bool scan_lines(const uint8_t *data, size_t length, size_t target, size_t *position, escape_state_t *state, int *lines)
+{
+    size_t pos = *position;
+    bool found = false;
+
+    while (pos < length && !found) {
+        if (*state != ESCAPE_STATE_OUT) {
+            pos += skip_escape_sequence(data + pos, length - pos, state, lines);
+
+            /* Bytes of non-ASCII characters, taken one at a time since only the first
+             * can end a sequence. */
+            if (pos < length && *state != ESCAPE_STATE_OUT) {
+                uint8_t next = escape_transitions[*state][ESCAPE_CLASS(data[pos])];
+                if (next == ESCAPE_STATE_NONE) {
+                    *state = ESCAPE_STATE_OUT;
+                } else {
+                    *state = next;
+                    pos++;
+                }
+            }
+            continue;
+        }
+
+        const uint8_t *escape = memchr(data + pos, ESCAPE_CHAR, length - pos);
+        size_t end = escape ? (size_t)(escape - data) : length;
+        const uint8_t *newline;
+
+        while (!found && (newline = memchr(data + pos, NEWLINE, end - pos)) != NULL) {
+            (*lines)++;
+            pos = newline - data + 1;
+            found = (pos > target);
+        }
+
+        if (!found) {
+            pos = end;
+            if (escape) {
+                pos++;
+                *state = ESCAPE_STATE_ESCAPE;
+            }
+        }
+    }
+
+    *position = pos;
+    return found;
+}
+
+/* Colorizes a chunk into its output, growing it until the whole chunk fits. */
+static void colorize_chunk(parallel_chunk_t *chunk)
+{
+    size_t position = 0;
+    size_t consumed;
+
+    chunk->colorizer.output = &chunk->output;
+    do {
+        if (output_reserve(&chunk->output, PARALLEL_OUTPUT_RESERVE) < 0) {
+            chunk->status = -1;
+            break;
+        }
+        chunk->status = colorize_utf8(&chunk->colorizer, chunk->data + position, chunk->length - position, &consumed);
+        position += consumed;
+    } while (chunk->status > 0);
+    chunk->error = errno;
+}
+
+static void *parallel_worker(void *arg)
+{
+    parallel_job_t *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (job->claimed == job->produced && !job->finished)
+            pthread_cond_wait(&job->changed, &job->lock);
+        if (job->claimed == job->produced)
+            break;
+
+        parallel_chunk_t *chunk = &job->chunks[job->claimed++ % job->window];
+        pthread_mutex_unlock(&job->lock);
+
+        colorize_chunk(chunk);
+
+        pthread_mutex_lock(&job->lock);
+        chunk->done = true;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+/* Chunks start right after a newline outside an escape sequence, where the
+ * colorizer state is fully known from the number of lines before them, so the
+ * output is the same as colorize_utf8's. */
+int queercat_colorize_parallel(queercat_t *queercat, const void *input, size_t length, int jobs,
+        queercat_write_f *write, void *cookie)
+{
+    const uint8_t *data = input;
+    parallel_job_t job = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER
+    };
+    size_t position = 0;
+    size_t written = 0;
+    bool chunk_failed = false;
+    int chunk_error = 0;
+    int started = 0;
+    colorizer_t state = queercat->colorizer;
+
+    /* No more threads than there are chunks. */
+    if (jobs < 1)
+        jobs = 1;
+    if ((size_t)jobs > length / PARALLEL_CHUNK_SIZE + 1)
+        jobs = length / PARALLEL_CHUNK_SIZE + 1;
+    job.window = 2 * jobs;
+
+    pthread_t *threads = malloc(jobs * sizeof(*threads));
+    job.chunks = calloc(job.window, sizeof(*job.chunks));
+    if (threads == NULL || job.chunks == NULL) {
+        free(threads);
+        free(job.chunks);
+        return -1;
+    }
+
+    /* The input is a whole one. */
+    queercat->pending_length = 0;
+
+    /* The workers share the escape table, so it is filled before they start. */
+    if (queercat->options.print_colors)
+        for (unsigned int i = 0; i < queercat->escape_table.count; i++)
+            table_escape(&queercat->options, &queercat->escape_table, i);
+
+    /* Go on with the threads there are, if the system is short of them. */
+    while (started < jobs && !pthread_create(&threads[started], NULL, parallel_worker, &job))
+        started++;
+
+    for (;;) {
+        bool can_split = position < length && !chunk_failed;
+
+        if (can_split && job.produced - written < job.window) {
+            /* Cut the next chunk, starting from the state the previous one ends in. */
+            parallel_chunk_t *chunk = &job.chunks[job.produced % job.window];
+            escape_state_t escape_state = state.escape_state;
+            int lines = 0;
+
+            chunk->output.length = 0;
+            chunk->colorizer = state;
+            chunk->colorizer.escape_sequences = 0;
+            chunk->colorizer.color_escapes = 0;
+            chunk->done = false;
+
+            chunk->data = data + position;
+            scan_lines(data, length, position + PARALLEL_CHUNK_SIZE, &position, &escape_state, &lines);
+            chunk->length = data + position - chunk->data;
+
+            state.char_index = 0;
+            state.line_index += lines;
+            state.last_color_id = COLOR_ID_NONE;
+            state.escape_state = ESCAPE_STATE_OUT;
+
+            pthread_mutex_lock(&job.lock);
+            job.produced++;
+            pthread_cond_broadcast(&job.changed);
+            pthread_mutex_unlock(&job.lock);
+
+        } else if (written < job.produced) {
+            /* Write the oldest chunk once it is done. Nothing after a failed chunk is written. */
+            parallel_chunk_t *chunk = &job.chunks[written % job.window];
+
+            if (started == 0) {
+                /* Without any thread, colorize it here. */
+                job.claimed++;
+                colorize_chunk(chunk);
+            } else {
+                pthread_mutex_lock(&job.lock);
+                while (!chunk->done)
+                    pthread_cond_wait(&job.changed, &job.lock);
+                pthread_mutex_unlock(&job.lock);
+            }
+
+            if (!chunk_failed) {
+                write(cookie, chunk->output.data, chunk->output.length);
+
+                chunk->colorizer.output = NULL;
+                chunk->colorizer.escape_sequences += queercat->colorizer.escape_sequences;
+                chunk->colorizer.color_escapes += queercat->colorizer.color_escapes;
+                queercat->colorizer = chunk->colorizer;
+
+                if (chunk->status < 0) {
+                    chunk_failed = true;
+                    chunk_error = chunk->error;
+                }
+            }
+            written++;
+
+        } else if (!can_split) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.finished = true;
+    pthread_cond_broadcast(&job.changed);
+    pthread_mutex_unlock(&job.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (size_t i = 0; i < job.window; i++)
+        free(job.chunks[i].output.data);
+    free(job.chunks);
+
+    errno = chunk_error;
+    return chunk_failed ? -1 : 0;
+}
+
+/* Colorizes data into an allocated output, growing it as needed. Returns like
+ * queercat_colorize, or -1 with errno set to ENOMEM. */
+static int colorize_all(queercat_t *queercat, const uint8_t *data, size_t length, output_t *output)
+{
+    size_t position = 0;
+
+    while (position < length) {
+        size_t consumed;
+        size_t written;
+
+        if (output_reserve(output, QUEERCAT_MIN_OUTPUT_SIZE + 2 * (length - position)) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int status = queercat_colorize(queercat, data + position, length - position, &consumed,
+                output->data + output->length, output->capacity - output->length, &written);
+        output->length += written;
+        position += consumed;
+        if (status < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Splits a line into cells, giving the width of the line. Returns the number of
+ * cells, or 0 if the line has anything the cursor cannot be moved over: invalid
+ * or incomplete UTF-8, and control characters, which escape sequences start with. */
+static size_t split_cells(const uint8_t *data, size_t length, animation_cell_t *cells, int *width)
+{
+    size_t count = 0;
+    size_t position = 0;
+
+    *width = 0;
+    while (position < length) {
+        wint_t current_char;
+        int sequence_length = decode_utf8(data + position, length - position, &current_char);
+
+        if (sequence_length <= 0 || current_char < 0x20 || (0x7f <= current_char && current_char < 0xa0))
+            return 0;
+
+        int cell_width = char_width(current_char);
+        if (cell_width == 0 && count > 0) {
+            cells[count - 1].length += sequence_length;
+        } else {
+            *width += cell_width;
+            cells[count++] = (animation_cell_t){
+                .offset = position,
+                .length = sequence_length,
+                .column = *width - cell_width,
+                .char_index = *width
+            };
+        }
+        position += sequence_length;
+    }
+
+    return count;
+}
+
+/* Moves the cursor along the line, relative to where it is. */
+static void move_cursor(output_t *output, int from, int to)
+{
+    if (to > from)
+        output->length += sprintf(output->data + output->length, "\033[%dC", to - from);
+    else if (to < from)
+        output->length += sprintf(output->data + output->length, "\033[%dD", from - to);
+}
+
+/* Bytes move_cursor writes. */
+static size_t move_length(int from, int to)
+{
+    unsigned int distance = (to > from) ? to - from : from - to;
+    size_t length = strlen("\033[C");
+
+    if (distance == 0)
+        return 0;
+    for (; distance > 0; distance /= 10)
+        length++;
+    return length;
+}
+
+/* Draws a frame of an animated line: the cells whose color is not shown yet, or
+ * all of them if full. Going forward, unchanged cells are written again rather
+ * than moved over when that takes fewer bytes, as it does when they are few and
+ * need no color escape. Returns 0, or -1 if out of memory. */
+static int draw_frame(const uint8_t *data, const animation_cell_t *cells, size_t count, bool full,
+        frame_state_t *state, output_t *output)
+{
+    int width = cells[count - 1].char_index;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!full && cells[i].escape->color_id == cells[i].shown_color_id)
+            continue;
+
+        int cursor_column = (state->cursor < count) ? cells[state->cursor].column : width;
+        size_t move = move_length(cursor_column, cells[i].column);
+        bool rewrite = state->cursor <= i;
+
+        /* Price writing the cells up to this one again, giving up once moving is cheaper. */
+        int last_color_id = state->last_color_id;
+        size_t rewrite_length = 0;
+        for (size_t j = state->cursor; rewrite && j < i; j++) {
+            if (cells[j].escape->color_id != last_color_id)
+                rewrite_length += cells[j].escape->length;
+            last_color_id = cells[j].escape->color_id;
+            rewrite_length += cells[j].length;
+            rewrite = rewrite_length <= move;
+        }
+
+        if (!rewrite) {
+            if (output_reserve(output, MAX_CURSOR_MOVE_LENGTH) < 0)
+                return -1;
+            move_cursor(output, cursor_column, cells[i].column);
+            state->cursor = i;
+        }
+
+        for (; state->cursor <= i; state->cursor++) {
+            const animation_cell_t *cell = &cells[state->cursor];
+
+            if (output_reserve(output, MAX_COLOR_ESCAPE_LENGTH + cell->length) < 0)
+                return -1;
+            if (cell->escape->color_id != state->last_color_id) {
+                output_write_escape(output, cell->escape);
+                state->last_color_id = cell->escape->color_id;
+                state->color_escapes++;
+            }
+            output_write(output, data + cell->offset, cell->length);
+        }
+    }
+
+    return 0;
+}
+
+int queercat_animate_line(queercat_t *queercat, const void *line, size_t length, int frames, int columns,
+        queercat_write_f *write, void *cookie)
+{
+    colorizer_t *colorizer = &queercat->colorizer;
+    const queercat_options_t *options = &queercat->options;
+    const uint8_t *data = line;
+    bool newline = length > 0 && data[length - 1] == NEWLINE;
+    size_t text_length = length - newline;
+    output_t output = { 0 };
+    output_t redraw = { 0 };
+    size_t count = 0;
+    int width = 0;
+
+    animation_cell_t *cells = malloc(text_length * sizeof(*cells) + 1);
+    if (cells == NULL)
+        goto out_of_memory;
+
+    if (options->print_colors && options->color_type != QUEERCAT_COLOR_TYPE_HTML
+            && queercat->pending_length == 0 && colorizer->escape_state == ESCAPE_STATE_OUT)
+        count = split_cells(data, text_length, cells, &width);
+
+    /* Draw anything else once, the usual way. */
+    if (count == 0 || (columns > 0 && width >= columns)) {
+        int status = colorize_all(queercat, data, length, &output);
+        if (status == 0 || errno == EILSEQ)
+            write(cookie, output.data, output.length);
+
+        free(output.data);
+        free(cells);
+        return (status < 0) ? -1 : 1;
+    }
+
+    /* Each frame moves the colors a column to the right. */
+    color_phase_t start = line_phase(colorizer);
+    frame_state_t state = { .cursor = 0, .last_color_id = colorizer->last_color_id, .color_escapes = 0 };
+
+    for (int frame = 0; frame < frames; frame++) {
+        color_phase_t phase = start - (color_phase_t)frame * colorizer->column_step;
+
+        for (size_t i = 0; i < count; i++)
+            cells[i].escape = table_escape(options, &queercat->escape_table, color_index(options, options->color_type,
+                    phase + (color_phase_t)cells[i].char_index * colorizer->column_step));
+
+        /* Only the cells whose color changed are written again, unless drawing
+         * the whole line over takes fewer bytes, as it does when most did. */
+        frame_state_t changes = state;
+        output.length = 0;
+        if (draw_frame(data, cells, count, frame == 0, &changes, &output) < 0)
+            goto out_of_memory;
+
+        if (frame > 0) {
+            frame_state_t whole = state;
+            redraw.length = 0;
+            if (draw_frame(data, cells, count, true, &whole, &redraw) < 0)
+                goto out_of_memory;
+
+            if (redraw.length < output.length) {
+                output_t swap = output;
+                output = redraw;
+                redraw = swap;
+                changes = whole;
+            }
+        }
+
+        state = changes;
+        for (size_t i = 0; i < count; i++)
+            cells[i].shown_color_id = cells[i].escape->color_id;
+
+        /* Leave the cursor after the line, as if it had been written once. */
+        if (frame == frames - 1) {
+            if (output_reserve(&output, MAX_CURSOR_MOVE_LENGTH + strlen(RESET_ESCAPE) + 1) < 0)
+                goto out_of_memory;
+
+            move_cursor(&output, (state.cursor < count) ? cells[state.cursor].column : width, width);
+            output_write(&output, RESET_ESCAPE, strlen(RESET_ESCAPE));
+            state.last_color_id = COLOR_ID_NONE;
+            if (newline)
+                output_write(&output, "\n", 1);
+        }
+
+        write(cookie, output.data, output.length);
+    }
+
+    colorizer->last_color_id = state.last_color_id;
+    colorizer->color_escapes += state.color_escapes;
+    if (newline) {
+        colorizer->line_index++;
+        colorizer->char_index = 0;
+    } else {
+        colorizer->char_index += width;
+    }
+
+    free(output.data);
+    free(redraw.data);
+    free(cells);
+    return frames;
+
+out_of_memory:
+    free(output.data);
+    free(redraw.data);
+    free(cells);
+    errno = ENOMEM;
+    return -1;
+}
+
+static void mix_colors(uint32_t color1, uint32_t color2, float balance, float factor, queercat_color_t *output_color)
+{
+    uint8_t red_1   = (color1 & 0xff0000) >> 16;
+    uint8_t green_1 = (color1 & 0x00ff00) >>  8;
+    uint8_t blue_1  = (color1 & 0x0000ff) >>  0;
+
+    uint8_t red_2   = (color2 & 0xff0000) >> 16;
+    uint8_t green_2 = (color2 & 0x00ff00) >>  8;
+    uint8_t blue_2  = (color2 & 0x0000ff) >>  0;
+
+    balance = pow(balance, factor);
+
+    output_color->red = lrintf(red_1 * balance + red_2 * (1.0f - balance));
+    output_color->green = lrintf(green_1 * balance + green_2 * (1.0f - balance));
+    output_color->blue = lrintf(blue_1 * balance + blue_2 * (1.0f - balance));
+}
+
+void queercat_get_color_rainbow (const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color)
+{
+    /* Unused variables. */
+    UNUSED(color_pattern);
+
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Generate the color. */
+    color->red   = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 0            ))) * 255.0f);
+    color->green = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 2 * M_PI / 3 ))) * 255.0f);
+    color->blue  = lrintf((1.0f * (0.5f + 0.5f * sin(theta + 4 * M_PI / 3 ))) * 255.0f);
+}
+
+void queercat_get_color_stripes (const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color)
+{
+    /* Get theta in range. */
+    while (theta < 0) theta += 2.0f * (float)M_PI;
+    while (theta >= 2.0f * (float)M_PI) theta -= 2.0f * (float)M_PI;
+
+    /* Find the stripe based on theta and generate the color. */
+    for (int i = 0; i < color_pattern->stripes_count; i++) {
+        float stripe_size = (2.0f * M_PI) / color_pattern->stripes_count;
+        float min_theta = i * stripe_size;
+        float max_theta = (i + 1) * stripe_size;
+
+        if (min_theta <= theta && max_theta > theta) {
+            float balance = 1 - ((theta - min_theta) / stripe_size);
+            mix_colors(
+                    color_pattern->stripes_colors[i],
+                    NEXT_CYCLIC_ELEMENT(color_pattern->stripes_colors, i, color_pattern->stripes_count),
+                    balance,
+                    color_pattern->factor,
+                    color);
+            return;
+        }
+    }
+}
+
+void queercat_build_color_table(const queercat_pattern_t *pattern, queercat_color_t *colors)
+{
+    for (int i = 0; i < QUEERCAT_COLOR_TABLE_SIZE; i++)
+        color_at(pattern, i, &colors[i]);
+}
+
+/* Gets entry index of the pattern's color table, computing it if the pattern
+ * has none. Flags loaded from a cache come with their colors. */
+static void color_at(const queercat_pattern_t *pattern, unsigned int index, queercat_color_t *color)
+{
+    if (pattern->color_table != NULL) {
+        *color = pattern->color_table[index];
+        return;
+    }
+
+    float theta = index * (2.0f * (float)M_PI / QUEERCAT_COLOR_TABLE_SIZE);
+    pattern->get_color(&pattern->color_pattern, theta, color);
+}
+
+/* Sizes the table for the color type, with none of it formatted yet. */
+static int build_escape_table(const queercat_options_t *options, escape_table_t *escape_table)
+{
+    switch (options->color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            escape_table->count = QUEERCAT_COLOR_TABLE_SIZE;
+            break;
+
+        case QUEERCAT_COLOR_TYPE_ANSII:
+            escape_table->count = options->pattern->ansii_pattern.codes_count;
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    for (unsigned int i = 0; i < escape_table->count; i++)
+        escape_table->escapes[i].length = 0;
+    return 0;
+}
+
+/* Formats entry index of the table. With max_colors, the table is split into
+ * that many bands, each in the color at its middle. */
+static void format_escape(const queercat_options_t *options, escape_table_t *escape_table, unsigned int index)
+{
+    const queercat_pattern_t *pattern = options->pattern;
+    color_escape_t *escape = &escape_table->escapes[index];
+    unsigned int count = escape_table->count;
+    char bytes[MAX_COLOR_ESCAPE_LENGTH + 1];
+    queercat_color_t color;
+    queercat_ansii_code_t code;
+
+    if (options->max_colors > 0 && (unsigned int)options->max_colors < count) {
+        unsigned int band = (unsigned long)index * options->max_colors / count;
+        index = (unsigned long)(2 * band + 1) * count / (2 * options->max_colors);
+    }
+
+    switch (options->color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            color_at(pattern, index, &color);
+            if (options->color_type == QUEERCAT_COLOR_TYPE_HTML)
+                escape->length = snprintf(bytes, sizeof(bytes), "<span style=color:#%02x%02x%02x>", color.red, color.green, color.blue);
+            else
+                escape->length = snprintf(bytes, sizeof(bytes), "\033[38;2;%d;%d;%dm", color.red, color.green, color.blue);
+            escape->color_id = (color.red << 16) | (color.green << 8) | color.blue;
+            break;
+
+        default:
+            code = pattern->ansii_pattern.ansii_codes[index];
+
+            /* The first 16 colors of the palette have shorter forms of their own. */
+            if (code < 8)
+                escape->length = snprintf(bytes, sizeof(bytes), "\033[%dm", 30 + code);
+            else if (code < 16)
+                escape->length = snprintf(bytes, sizeof(bytes), "\033[%dm", 90 + code - 8);
+            else
+                escape->length = snprintf(bytes, sizeof(bytes), "\033[38;5;%hhum", code);
+            escape->color_id = code;
+            break;
+    }
+    memcpy(escape->bytes, bytes, escape->length);
+}
+
+/* Returns entry index of the table, formatting it the first time. */
+static inline const color_escape_t *table_escape(const queercat_options_t *options, escape_table_t *escape_table, unsigned long index)
+{
+    color_escape_t *escape = &escape_table->escapes[index];
+
+    if (__builtin_expect(escape->length == 0, 0))
+        format_escape(options, escape_table, index);
+    return escape;
+}
+
+/* Converts a position in periods to a phase, rounding up, so that a position
+ * right on the edge of an ANSI band is in the band it starts. */
+static color_phase_t phase_from_periods(double periods)
+{
+    return (color_phase_t)(uint64_t)ceil((periods - floor(periods)) * 4294967296.0);
+}
+
+/* Returns the phase at the first column of the current line, working it out
+ * once per line. */
+static inline color_phase_t line_phase(colorizer_t *colorizer)
+{
+    const queercat_options_t *options = colorizer->options;
+    unsigned int codes_count;
+    double periods;
+
+    if (colorizer->line_start_index == colorizer->line_index)
+        return colorizer->line_start;
+
+    switch (options->color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            periods = (colorizer->line_index * options->freq_v
+                    + (options->offx + 2.0 * options->rand_offset / RAND_MAX) * M_PI) / (2.0 * M_PI);
+            break;
+
+        case QUEERCAT_COLOR_TYPE_ANSII:
+            /* The offsets shift the colors by whole codes. */
+            codes_count = options->pattern->ansii_pattern.codes_count;
+            periods = ((int)(options->offx * codes_count) + options->rand_offset % codes_count
+                    + colorizer->line_index * options->freq_v) / codes_count;
+            break;
+
+        default:
+            /* queercat_create takes no other color type. */
+            periods = 0;
+            break;
+    }
+
+    colorizer->line_start = phase_from_periods(periods);
+    colorizer->line_start_index = colorizer->line_index;
+    return colorizer->line_start;
+}
+
+/* Returns the index of the color at phase: the nearest color table entry in
+ * 24-bit and HTML mode, and the code whose band it is in in ANSI mode. */
+static inline unsigned long color_index(const queercat_options_t *options, queercat_color_type_t color_type, color_phase_t phase)
+{
+    switch (color_type) {
+        case QUEERCAT_COLOR_TYPE_24_BIT:
+        case QUEERCAT_COLOR_TYPE_HTML:
+            return (color_phase_t)(phase + (1u << (31 - QUEERCAT_COLOR_TABLE_BITS))) >> (32 - QUEERCAT_COLOR_TABLE_BITS);
+
+        case QUEERCAT_COLOR_TYPE_ANSII:
+            return ((uint64_t)phase * options->pattern->ansii_pattern.codes_count) >> 32;
+
+        default:
+            /* queercat_create takes no other color type. */
+            return 0;
+    }
+}
+
+/* Returns the escape sequence for the color at the current position. */
+static const color_escape_t *current_escape(colorizer_t *colorizer)
+{
+    const queercat_options_t *options = colorizer->options;
+
+    if (colorizer->column_row != NULL && colorizer->char_index < COLUMN_ROW_SIZE)
+        return table_escape(options, colorizer->escape_table, colorizer->column_row[colorizer->char_index]);
+
+    color_phase_t phase = line_phase(colorizer) + (color_phase_t)colorizer->char_index * colorizer->column_step;
+    return table_escape(options, colorizer->escape_table, color_index(options, options->color_type, phase));
+}
+
+/* Emits the color for the current position, unless the terminal already shows it
+ * or shows the previous color for fewer than min_run cells so far. */
+static void print_color(colorizer_t *colorizer, int width)
+{
+    const color_escape_t *escape = current_escape(colorizer);
+
+    if (escape->color_id != colorizer->last_color_id
+            && (colorizer->run_length >= colorizer->options->min_run || colorizer->last_color_id == COLOR_ID_NONE)) {
+        output_write_color(colorizer->output, escape, colorizer->options->color_type, colorizer->last_color_id);
+        colorizer->last_color_id = escape->color_id;
+        colorizer->color_escapes++;
+        colorizer->run_length = 0;
+    }
+    colorizer->run_length += width;
+}
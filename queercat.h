@@ -0,0 +1,179 @@
+#ifndef QUEERCAT_H
+#define QUEERCAT_H
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* *** Constants *****************************************************/
+#define QUEERCAT_MAX_FLAG_STRIPES (6)
+#define QUEERCAT_MAX_ANSII_CODES_PER_STRIPE (5)
+#define QUEERCAT_MAX_ANSII_CODES_COUNT (QUEERCAT_MAX_FLAG_STRIPES * QUEERCAT_MAX_ANSII_CODES_PER_STRIPE)
+#define QUEERCAT_MAX_FLAG_NAME_LENGTH (64)
+
+/* Resolution of the table of 24-bit colors over one period of theta. At 4096
+ * steps every flag stays within one level per channel of computing the color
+ * for each character directly, which no terminal can tell apart. */
+#define QUEERCAT_COLOR_TABLE_BITS (12)
+#define QUEERCAT_COLOR_TABLE_SIZE (1 << QUEERCAT_COLOR_TABLE_BITS)
+
+/* Output buffers passed to the colorizer must have room for at least this many
+ * bytes, enough for one color escape and one encoded character. */
+#define QUEERCAT_MIN_OUTPUT_SIZE (64)
+
+
+/* *** Types *********************************************************/
+/* Colors. */
+typedef uint32_t queercat_hex_color_t;
+typedef unsigned char queercat_ansii_code_t;
+typedef struct queercat_color_s {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} queercat_color_t;
+
+/* Color type patterns. */
+typedef enum queercat_color_type_e {
+    QUEERCAT_COLOR_TYPE_INVALID = -1,
+    QUEERCAT_COLOR_TYPE_ANSII = 0,
+    QUEERCAT_COLOR_TYPE_24_BIT,
+    QUEERCAT_COLOR_TYPE_HTML, /* 24-bit colors as <span style=color:#rrggbb> around each run of a color. */
+    QUEERCAT_COLOR_TYPE_COUNT
+} queercat_color_type_t;
+typedef struct queercat_ansii_pattern_s {
+    unsigned int codes_count;
+    unsigned char ansii_codes[QUEERCAT_MAX_ANSII_CODES_COUNT];
+} queercat_ansii_pattern_t;
+typedef struct queercat_color_pattern_s {
+    uint8_t stripes_count;
+    uint32_t stripes_colors[QUEERCAT_MAX_FLAG_STRIPES];
+    float factor;
+} queercat_color_pattern_t;
+
+/* Get color function. */
+typedef void(queercat_get_color_f)(const queercat_color_pattern_t *color_pattern, float theta, queercat_color_t *color);
+
+/* Pattern. */
+typedef struct queercat_pattern_s {
+    char name[QUEERCAT_MAX_FLAG_NAME_LENGTH];
+    queercat_ansii_pattern_t ansii_pattern;
+    queercat_color_pattern_t color_pattern;
+    queercat_get_color_f *get_color;
+    const queercat_color_t *color_table; /* QUEERCAT_COLOR_TABLE_SIZE colors from get_color, or NULL to compute them. */
+} queercat_pattern_t;
+
+/* Colorizer. */
+typedef struct queercat_options_s {
+    const queercat_pattern_t *pattern;
+    queercat_color_type_t color_type;
+    double freq_h;
+    double freq_v;
+    double offx;
+    int rand_offset;
+    bool print_colors;
+    int max_colors; /* Bands the flag is quantized to, or 0 for a smooth gradient. */
+    int min_run;    /* Cells a color is kept for at least, or 0. */
+} queercat_options_t;
+typedef struct queercat_s queercat_t;
+
+/* What a colorizer has done since it was created or reset. */
+typedef struct queercat_stats_s {
+    size_t colorized_escape_sequences;      /* Escape sequences passed through while colorizing. */
+    size_t color_escapes[QUEERCAT_COLOR_TYPE_COUNT]; /* Color escapes emitted, by color type. */
+} queercat_stats_t;
+
+/* Receives output, in order, from queercat_colorize_parallel. */
+typedef void(queercat_write_f)(void *cookie, const void *data, size_t length);
+
+
+/* *** Functions *****************************************************/
+/* Pattern functions */
+queercat_get_color_f queercat_get_color_rainbow;
+queercat_get_color_f queercat_get_color_stripes;
+
+/* Returns the flag with the given name or number, or NULL. */
+const queercat_pattern_t *queercat_lookup_pattern(const char *name);
+
+/* Adds flags after the built-in ones, numbered on from them. The patterns must
+ * stay valid for as long as they are used. Not thread safe: add them before
+ * looking any flag up. Returns 0, or -1 with errno set. */
+int queercat_add_patterns(const queercat_pattern_t *patterns, int count);
+
+/* Counts the flags, built-in and added, and gets them by number. */
+int queercat_pattern_count(void);
+const queercat_pattern_t *queercat_pattern(int number);
+int queercat_pattern_number(const queercat_pattern_t *pattern);
+
+/* Samples get_color over one period of theta, the way the colorizer does, into
+ * QUEERCAT_COLOR_TABLE_SIZE colors. */
+void queercat_build_color_table(const queercat_pattern_t *pattern, queercat_color_t *colors);
+
+/* Creates a colorizer, with a table for the escape sequences of its pattern,
+ * which are formatted as they are first used. This is the only call that
+ * allocates. Returns NULL with errno set on failure. */
+queercat_t *queercat_create(const queercat_options_t *options);
+void queercat_destroy(queercat_t *queercat);
+
+/* Like queercat_create, but reuses the escape sequences base has formatted when
+ * the pattern, color type, print_colors and max_colors options are the same,
+ * which saves formatting them again. */
+queercat_t *queercat_copy(const queercat_t *base, const queercat_options_t *options);
+
+/* Goes back to the first line and column, as if nothing had been colorized. */
+void queercat_reset(queercat_t *queercat);
+
+/* Gets the counts of the colorizer, which cost next to nothing to keep. Escape
+ * sequences are only followed, and counted, when printing colors: without them
+ * the input is copied as it is, and colorized_escape_sequences stays 0. */
+void queercat_get_stats(const queercat_t *queercat, queercat_stats_t *stats);
+
+/* Colorizes UTF-8 input into output. In HTML mode, spans close at the end of
+ * every line and input, <, > and & are written as entities, and escape
+ * sequences are left out but for the newlines they carry out. Stops early only
+ * when output is full, with *input_consumed telling how much input to pass
+ * again. A character split across calls is kept until its remaining bytes
+ * arrive. Returns 0, or -1 with errno set to EILSEQ on invalid input, in which
+ * case the input before it was colorized. */
+int queercat_colorize(queercat_t *queercat, const void *input, size_t input_length, size_t *input_consumed,
+        void *output, size_t output_size, size_t *output_written);
+
+/* Colorizes one already decoded character, given with its encoded bytes. This is
+ * the reference the shortcuts of queercat_colorize are checked against: every
+ * character goes through the escape state machine and has its color worked out
+ * on its own. Returns -1 with errno set to ENOBUFS if output has less than
+ * QUEERCAT_MIN_OUTPUT_SIZE bytes. */
+int queercat_colorize_char(queercat_t *queercat, uint32_t current_char, const char *bytes, size_t length,
+        void *output, size_t output_size, size_t *output_written);
+
+/* Ends an input: drops an incomplete trailing character and resets the colors.
+ * The next input continues on the same line. Same return as
+ * queercat_colorize_char. */
+int queercat_end_input(queercat_t *queercat, void *output, size_t output_size, size_t *output_written);
+
+/* Colorizes a whole in-memory input on jobs threads, or as many as can be
+ * started, with the same result as queercat_colorize. Without any, it colorizes
+ * on the calling thread. Output goes to write in order. Allocates its work
+ * buffers. Returns 0, or -1 with errno set to EILSEQ after writing the output
+ * up to the invalid input, or to ENOMEM. */
+int queercat_colorize_parallel(queercat_t *queercat, const void *input, size_t length, int jobs,
+        queercat_write_f *write, void *cookie);
+
+/* Animates one line of UTF-8 input, with its newline if it has one, for frames
+ * frames, moving the colors a column to the right each frame. The first frame
+ * draws the line from the cursor on, and every other one only rewrites the
+ * cells whose color changed, moving the cursor over the rest, or draws the line
+ * again when that takes fewer bytes. The last one leaves the cursor after the
+ * line with the colors reset. Each frame goes to write in one call, even when
+ * nothing changed, so that the caller can pace them. Empty lines, lines the
+ * cursor cannot be moved over, that is with control characters or escape
+ * sequences, lines in HTML mode, and lines as wide as columns or wider, which
+ * wrap, are colorized once instead, as one frame; columns is 0 if the width is
+ * unknown. Allocates its work buffers. Returns the number of frames, or -1 with
+ * errno set to EILSEQ after writing the output up to invalid input, or to
+ * ENOMEM. */
+int queercat_animate_line(queercat_t *queercat, const void *line, size_t length, int frames, int columns,
+        queercat_write_f *write, void *cookie);
+
+#endif /* QUEERCAT_H */
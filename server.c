@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "queercat.h"
+#include "server.h"
+
+
+/* *** Common ********************************************************/
+/* Macros */
+#define UNUSED(var) ((void)(var))
+
+
+/* *** Constants *****************************************************/
+#define FRAME_HEADER_LENGTH (5)
+#define MAX_FRAME_LENGTH (64 * 1024)
+#define MAX_OPTIONS_LENGTH (1024)
+#define LISTEN_BACKLOG (64)
+
+/* Frames from the client. */
+#define FRAME_OPTIONS 'C'
+#define FRAME_INPUT 'I'
+#define FRAME_END_OF_INPUT 'E'
+
+/* Frames from the server. */
+#define FRAME_OUTPUT 'O'
+#define FRAME_INPUT_ENDED 'E'
+#define FRAME_ERROR 'X'
+#define FRAME_DONE 'D'
+
+
+/* *** Types *********************************************************/
+/* A frame is a type byte, a big-endian 32-bit length and that many bytes of data.
+ * The header is kept in front of the data so that a frame goes out in one piece. */
+typedef struct frame_s {
+    char header[FRAME_HEADER_LENGTH];
+    char data[MAX_FRAME_LENGTH];
+} frame_t;
+
+/* What stopped the client from sending an input. */
+typedef enum input_error_e {
+    INPUT_ERROR_NONE = 0,
+    INPUT_ERROR_OPEN,
+    INPUT_ERROR_READ,
+    INPUT_ERROR_CLOSE
+} input_error_t;
+
+/* Client state shared by the thread sending inputs and the one receiving output. */
+typedef struct client_s {
+    int fd;
+    char **inputs;
+    char **inputs_end;
+    const char *helpstr;
+    frame_t frame;
+    char **failed_input;
+    input_error_t input_error;
+    int error;
+} client_t;
+
+
+/* *** Globals *******************************************************/
+/* Colorizers kept warm for each pattern, color type and print_colors option. */
+static queercat_t **warm_colorizers;
+static pthread_mutex_t warm_colorizers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t server_stopping;
+
+/* Values of the color option, by color type. */
+static const char *const color_type_names[QUEERCAT_COLOR_TYPE_COUNT] = {
+    [QUEERCAT_COLOR_TYPE_ANSII] = "ansi",
+    [QUEERCAT_COLOR_TYPE_24_BIT] = "24bit",
+    [QUEERCAT_COLOR_TYPE_HTML] = "html"
+};
+
+
+/* *** Functions Declarations ****************************************/
+/* Frames */
+static int send_all(int fd, const void *data, size_t length);
+static int send_frame(int fd, frame_t *frame, char type, size_t length);
+static int receive_all(int fd, void *data, size_t length);
+static int receive_frame(int fd, frame_t *frame, char *type, size_t *length);
+
+/* Server */
+static void stop_server(int signal_number);
+static const char *parse_options(char *text, queercat_options_t *options);
+static queercat_t *create_colorizer(const queercat_options_t *options);
+static int colorize_frame(int fd, queercat_t *queercat, const frame_t *request, size_t length, frame_t *response);
+static void *serve_connection(void *arg);
+
+/* Client */
+static int send_input(client_t *client, int fd);
+static void *send_inputs(void *arg);
+
+
+/* *** Functions *****************************************************/
+static int send_all(int fd, const void *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data = (const char *)data + sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+static int send_frame(int fd, frame_t *frame, char type, size_t length)
+{
+    frame->header[0] = type;
+    frame->header[1] = length >> 24;
+    frame->header[2] = length >> 16;
+    frame->header[3] = length >> 8;
+    frame->header[4] = length;
+
+    return send_all(fd, frame->header, FRAME_HEADER_LENGTH + length);
+}
+
+/* Returns 1, 0 if the connection was closed before any data, or -1. */
+static int receive_all(int fd, void *data, size_t length)
+{
+    size_t received = 0;
+
+    while (received < length) {
+        ssize_t bytes_read = read(fd, (char *)data + received, length - received);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0) {
+            errno = ECONNRESET;
+            return (received == 0) ? 0 : -1;
+        }
+        received += bytes_read;
+    }
+
+    return 1;
+}
+
+/* Returns like receive_all. */
+static int receive_frame(int fd, frame_t *frame, char *type, size_t *length)
+{
+    uint8_t header[FRAME_HEADER_LENGTH];
+
+    int status = receive_all(fd, header, sizeof(header));
+    if (status <= 0)
+        return status;
+
+    *type = header[0];
+    *length = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 8) | header[4];
+    if (*length > MAX_FRAME_LENGTH) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return (receive_all(fd, frame->data, *length) < 0) ? -1 : 1;
+}
+
+static void stop_server(int signal_number)
+{
+    UNUSED(signal_number);
+    server_stopping = 1;
+}
+
+/* Reads "key=value" lines. Returns NULL, or the error to send back. */
+static const char *parse_options(char *text, queercat_options_t *options)
+{
+    char *saveptr;
+
+    *options = (queercat_options_t){ .color_type = QUEERCAT_COLOR_TYPE_ANSII, .freq_h = 0.23, .freq_v = 0.1, .print_colors = true };
+
+    for (char *line = strtok_r(text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        char *value = strchr(line, '=');
+        if (value == NULL)
+            return "Invalid options";
+        *value++ = '\0';
+
+        if (!strcmp(line, "flag")) {
+            options->pattern = queercat_lookup_pattern(value);
+            if (options->pattern == NULL)
+                return "Invalid flag";
+        } else if (!strcmp(line, "color")) {
+            options->color_type = QUEERCAT_COLOR_TYPE_INVALID;
+            for (int type = 0; type < QUEERCAT_COLOR_TYPE_COUNT; type++) {
+                if (!strcmp(value, color_type_names[type]))
+                    options->color_type = type;
+            }
+            if (options->color_type == QUEERCAT_COLOR_TYPE_INVALID)
+                return "Invalid color";
+        } else if (!strcmp(line, "freq_h")) {
+            options->freq_h = strtod(value, NULL);
+        } else if (!strcmp(line, "freq_v")) {
+            options->freq_v = strtod(value, NULL);
+        } else if (!strcmp(line, "offset")) {
+            options->offx = strtod(value, NULL);
+        } else if (!strcmp(line, "random")) {
+            options->rand_offset = atoi(value);
+        } else if (!strcmp(line, "colors")) {
+            options->print_colors = atoi(value) != 0;
+        } else if (!strcmp(line, "max_colors")) {
+            options->max_colors = atoi(value);
+        } else if (!strcmp(line, "min_run")) {
+            options->min_run = atoi(value);
+        }
+        /* Other keys are for newer servers. */
+    }
+
+    if (options->pattern == NULL)
+        options->pattern = queercat_pattern(0);
+
+    return NULL;
+}
+
+/* Copies the warm colorizer for these options, warming it up first if needed. */
+static queercat_t *create_colorizer(const queercat_options_t *options)
+{
+    int index = ((queercat_pattern_number(options->pattern) * QUEERCAT_COLOR_TYPE_COUNT) + options->color_type) * 2 + options->print_colors;
+    queercat_t *queercat = NULL;
+
+    pthread_mutex_lock(&warm_colorizers_lock);
+    if (warm_colorizers[index] == NULL)
+        warm_colorizers[index] = queercat_create(options);
+    if (warm_colorizers[index] != NULL)
+        queercat = queercat_copy(warm_colorizers[index], options);
+    pthread_mutex_unlock(&warm_colorizers_lock);
+
+    return queercat;
+}
+
+/* Colorizes an input frame into output frames. Returns -1 if the input is invalid
+ * or the client is gone. */
+static int colorize_frame(int fd, queercat_t *queercat, const frame_t *request, size_t length, frame_t *response)
+{
+    size_t position = 0;
+
+    for (;;) {
+        size_t consumed;
+        size_t written;
+        int status = queercat_colorize(queercat, request->data + position, length - position, &consumed,
+                response->data, sizeof(response->data), &written);
+        int colorize_errno = errno;
+        position += consumed;
+
+        if (written > 0 && send_frame(fd, response, FRAME_OUTPUT, written) < 0)
+            return -1;
+
+        if (status < 0) {
+            /* Reset the colors, then report the error. */
+            queercat_end_input(queercat, response->data, sizeof(response->data), &written);
+            if (written > 0 && send_frame(fd, response, FRAME_OUTPUT, written) < 0)
+                return -1;
+
+            const char *message = strerror(colorize_errno);
+            memcpy(response->data, message, strlen(message));
+            send_frame(fd, response, FRAME_ERROR, strlen(message));
+            return -1;
+        }
+
+        if (position == length)
+            return 0;
+    }
+}
+
+static void *serve_connection(void *arg)
+{
+    int fd = (intptr_t)arg;
+    frame_t *request = malloc(sizeof(*request));
+    frame_t *response = malloc(sizeof(*response));
+    queercat_t *queercat = NULL;
+    queercat_options_t options;
+    const char *error = NULL;
+    size_t length;
+    char type;
+
+    if (request == NULL || response == NULL)
+        goto done;
+
+    /* The options come first. */
+    if (receive_frame(fd, request, &type, &length) <= 0)
+        goto done;
+    if (type != FRAME_OPTIONS || length >= MAX_OPTIONS_LENGTH) {
+        error = "Expected options";
+    } else {
+        request->data[length] = '\0';
+        error = parse_options(request->data, &options);
+    }
+
+    if (error == NULL) {
+        queercat = create_colorizer(&options);
+        if (queercat == NULL)
+            error = strerror(errno);
+    }
+
+    if (error != NULL) {
+        memcpy(response->data, error, strlen(error));
+        send_frame(fd, response, FRAME_ERROR, strlen(error));
+        goto done;
+    }
+
+    for (;;) {
+        size_t written;
+        int status = receive_frame(fd, request, &type, &length);
+
+        if (status < 0)
+            break;
+
+        /* The client is done sending. */
+        if (status == 0) {
+            send_frame(fd, response, FRAME_DONE, 0);
+            break;
+        }
+
+        if (type == FRAME_INPUT) {
+            if (colorize_frame(fd, queercat, request, length, response) < 0)
+                break;
+
+        } else if (type == FRAME_END_OF_INPUT) {
+            queercat_end_input(queercat, response->data, sizeof(response->data), &written);
+            if ((written > 0 && send_frame(fd, response, FRAME_OUTPUT, written) < 0)
+                    || send_frame(fd, response, FRAME_INPUT_ENDED, 0) < 0)
+                break;
+
+        } else {
+            error = "Unexpected frame";
+            memcpy(response->data, error, strlen(error));
+            send_frame(fd, response, FRAME_ERROR, strlen(error));
+            break;
+        }
+    }
+
+done:
+    if (queercat != NULL)
+        queercat_destroy(queercat);
+    free(request);
+    free(response);
+    close(fd);
+    return NULL;
+}
+
+int serve(const char *socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct sigaction action = { .sa_handler = stop_server };
+    struct stat st;
+    pthread_attr_t attributes;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fwprintf(stderr, L"Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    warm_colorizers = calloc(queercat_pattern_count() * QUEERCAT_COLOR_TYPE_COUNT * 2, sizeof(*warm_colorizers));
+    if (warm_colorizers == NULL) {
+        fwprintf(stderr, L"%s\n", strerror(errno));
+        return 2;
+    }
+
+    /* Replace the socket of a server that is gone, which nothing listens on any
+     * more, but never that of one still serving. */
+    if (!stat(socket_path, &st) && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            fwprintf(stderr, L"%s\n", strerror(errno));
+            return 2;
+        }
+        if (!connect(probe, (struct sockaddr *)&address, sizeof(address))) {
+            fwprintf(stderr, L"A server is already listening on \"%s\"\n", socket_path);
+            close(probe);
+            return 2;
+        }
+        if (errno == ECONNREFUSED)
+            unlink(socket_path);
+        close(probe);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, LISTEN_BACKLOG)) {
+        fwprintf(stderr, L"Cannot listen on \"%s\": %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+
+    /* Interrupting accept is how the server stops. */
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    while (!server_stopping) {
+        pthread_t thread;
+
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fwprintf(stderr, L"Cannot accept connection: %s\n", strerror(errno));
+            continue;
+        }
+
+        if (pthread_create(&thread, &attributes, serve_connection, (void *)(intptr_t)fd))
+            close(fd);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return 0;
+}
+
+/* Sends the contents of fd. Returns -1 with client->input_error set if reading
+ * fails, or with it unset if sending does. */
+static int send_input(client_t *client, int fd)
+{
+    for (;;) {
+        ssize_t bytes_read = read(fd, client->frame.data, sizeof(client->frame.data));
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            client->input_error = INPUT_ERROR_READ;
+            client->error = errno;
+            return -1;
+        }
+
+        if (bytes_read == 0)
+            return 0;
+
+        if (send_frame(client->fd, &client->frame, FRAME_INPUT, bytes_read) < 0)
+            return -1;
+    }
+}
+
+/* Sends the inputs, each followed by its end, and stops at the first one that
+ * cannot be read. */
+static void *send_inputs(void *arg)
+{
+    client_t *client = arg;
+
+    for (char **filename = client->inputs; filename < client->inputs_end; filename++) {
+        int fd = -1;
+        int status = 0;
+
+        if (!strcmp(*filename, "--help")) {
+            const char *text = client->helpstr;
+            for (size_t length = strlen(text), chunk; status == 0 && length > 0; text += chunk, length -= chunk) {
+                chunk = (length < MAX_FRAME_LENGTH) ? length : MAX_FRAME_LENGTH;
+                memcpy(client->frame.data, text, chunk);
+                status = send_frame(client->fd, &client->frame, FRAME_INPUT, chunk);
+            }
+        } else {
+            fd = strcmp(*filename, "-") ? open(*filename, O_RDONLY) : STDIN_FILENO;
+            if (fd < 0) {
+                client->failed_input = filename;
+                client->input_error = INPUT_ERROR_OPEN;
+                client->error = errno;
+                break;
+            }
+            status = send_input(client, fd);
+        }
+
+        /* Like the command line, an input that cannot be read is still ended. */
+        bool read_failed = (client->input_error == INPUT_ERROR_READ);
+        if ((status == 0 || read_failed) && send_frame(client->fd, &client->frame, FRAME_END_OF_INPUT, 0) < 0)
+            status = -1;
+
+        if (read_failed) {
+            client->failed_input = filename;
+        } else if (fd >= 0 && fd != STDIN_FILENO && close(fd) && status == 0) {
+            client->failed_input = filename;
+            client->input_error = INPUT_ERROR_CLOSE;
+            client->error = errno;
+            status = -1;
+        }
+
+        if (status < 0)
+            break;
+    }
+
+    shutdown(client->fd, SHUT_WR);
+    return NULL;
+}
+
+int run_client(const char *socket_path, const queercat_options_t *options, char **inputs, char **inputs_end, const char *helpstr)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    static client_t client;
+    static frame_t response;
+    char **current_input = inputs;
+    pthread_t sender;
+    int exit_status = 0;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fwprintf(stderr, L"Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    client.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client.fd < 0 || connect(client.fd, (struct sockaddr *)&address, sizeof(address))) {
+        fwprintf(stderr, L"Cannot connect to \"%s\": %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+
+    int length = snprintf(client.frame.data, MAX_OPTIONS_LENGTH,
+            "flag=%s\ncolor=%s\nfreq_h=%.17g\nfreq_v=%.17g\noffset=%.17g\nrandom=%d\ncolors=%d\nmax_colors=%d\nmin_run=%d\n",
+            options->pattern->name, color_type_names[options->color_type],
+            options->freq_h, options->freq_v, options->offx, options->rand_offset, options->print_colors,
+            options->max_colors, options->min_run);
+    if (send_frame(client.fd, &client.frame, FRAME_OPTIONS, length) < 0) {
+        fwprintf(stderr, L"Cannot send to \"%s\": %s\n", socket_path, strerror(errno));
+        return 2;
+    }
+
+    client.inputs = inputs;
+    client.inputs_end = inputs_end;
+    client.helpstr = helpstr;
+    int error = pthread_create(&sender, NULL, send_inputs, &client);
+    if (error) {
+        fwprintf(stderr, L"Cannot send to \"%s\": %s\n", socket_path, strerror(error));
+        close(client.fd);
+        return 2;
+    }
+
+    for (;;) {
+        char type;
+        size_t frame_length;
+        int status = receive_frame(client.fd, &response, &type, &frame_length);
+
+        if (status <= 0) {
+            fwprintf(stderr, L"Connection to \"%s\" lost: %s\n", socket_path, strerror(status ? errno : ECONNRESET));
+            exit_status = 2;
+            break;
+        }
+
+        if (type == FRAME_OUTPUT) {
+            for (size_t written = 0; written < frame_length; ) {
+                ssize_t bytes_written = write(STDOUT_FILENO, response.data + written, frame_length - written);
+                if (bytes_written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    fwprintf(stderr, L"Error writing output: %s\n", strerror(errno));
+                    exit(2);
+                }
+                written += bytes_written;
+            }
+
+        } else if (type == FRAME_INPUT_ENDED) {
+            current_input++;
+
+        } else if (type == FRAME_ERROR) {
+            response.data[frame_length < MAX_FRAME_LENGTH ? frame_length : MAX_FRAME_LENGTH - 1] = '\0';
+            if (current_input < inputs_end)
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *current_input, response.data);
+            else
+                fwprintf(stderr, L"%s\n", response.data);
+            exit_status = 2;
+            break;
+
+        } else if (type == FRAME_DONE) {
+            break;
+
+        } else {
+            fwprintf(stderr, L"Connection to \"%s\" lost: %s\n", socket_path, strerror(EPROTO));
+            exit_status = 2;
+            break;
+        }
+    }
+
+    /* The sender may still be waiting for input that is not needed anymore. */
+    if (exit_status != 0)
+        pthread_cancel(sender);
+    pthread_join(sender, NULL);
+    close(client.fd);
+
+    if (exit_status == 0) {
+        switch (client.input_error) {
+            case INPUT_ERROR_OPEN:
+                fwprintf(stderr, L"Cannot open input file \"%s\": %s\n", *client.failed_input, strerror(client.error));
+                return 2;
+            case INPUT_ERROR_READ:
+                fwprintf(stderr, L"Error reading input file \"%s\": %s\n", *client.failed_input, strerror(client.error));
+                return 2;
+            case INPUT_ERROR_CLOSE:
+                fwprintf(stderr, L"Error closing input file \"%s\": %s\n", *client.failed_input, strerror(client.error));
+                return 2;
+            default:
+                break;
+        }
+    }
+
+    return exit_status;
+}
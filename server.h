@@ -0,0 +1,17 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* *** Includes ******************************************************/
+#include "queercat.h"
+
+
+/* *** Functions *****************************************************/
+/* Colorizes the requests of clients connecting to a unix socket at socket_path,
+ * until interrupted. Returns the exit status. */
+int serve(const char *socket_path);
+
+/* Has the server at socket_path colorize inputs to stdout, the way the command
+ * line does. helpstr is the text for "--help" inputs. Returns the exit status. */
+int run_client(const char *socket_path, const queercat_options_t *options, char **inputs, char **inputs_end, const char *helpstr);
+
+#endif /* SERVER_H */
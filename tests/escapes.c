@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+/* *** Includes ******************************************************/
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* *** Constants *****************************************************/
+#define MAX_COMMAND_LENGTH (4096)
+#define MAX_ESCAPE_LENGTH (64)
+#define RESET_ESCAPE "\033[0m"
+
+
+/* *** Types *********************************************************/
+/* A run of queercat on the test input, and the color escapes it must emit. */
+typedef struct escape_case_s {
+    const char *options;
+    size_t escapes;
+} escape_case_t;
+
+
+/* *** Cases *********************************************************/
+/* The counts are the color changes along each line of escapes.txt, worked out
+ * with exact fractions: the band of a character at column c of line l is
+ * floor(0.23 c + 0.1 l), and each line states its first color. */
+const escape_case_t cases[] = {
+    { .options = "-F -o 0", .escapes = 82 },
+    /* The codes of the flag come in pairs, which share an escape. */
+    { .options = "-F -o 0 -f 1", .escapes = 37 },
+    /* Every column has the same color, so each non-empty line has one escape. */
+    { .options = "-F -o 0 -b -h 0", .escapes = 7 },
+};
+
+const int CASE_COUNT = sizeof(cases)/sizeof(cases[0]);
+
+
+/* *** Functions *****************************************************/
+/* Runs queercat on input with the options of a case, and checks that it emits
+ * as many color escapes as expected, none of them for the color already set on
+ * the line. Lines state their first color again on purpose, so that each shows
+ * right on its own. Returns false after reporting what is wrong. */
+static bool check_case(const char *queercat, const char *input, const escape_case_t *escape_case)
+{
+    char command[MAX_COMMAND_LENGTH];
+    char current[MAX_ESCAPE_LENGTH] = "";
+    char escape[MAX_ESCAPE_LENGTH];
+    size_t escapes = 0;
+    bool repeated = false;
+    int c;
+
+    snprintf(command, sizeof(command), "'%s' %s '%s'", queercat, escape_case->options, input);
+    FILE *output = popen(command, "r");
+    if (output == NULL) {
+        perror("popen");
+        return false;
+    }
+
+    while ((c = getc(output)) != EOF) {
+        if (c == '\n') {
+            current[0] = '\0';
+            continue;
+        }
+        if (c != '\033')
+            continue;
+
+        /* Read the sequence up to its final byte. */
+        size_t length = 0;
+        escape[length++] = c;
+        while ((c = getc(output)) != EOF && length < sizeof(escape) - 1) {
+            escape[length++] = c;
+            if (length > 2 && 0x40 <= c && c <= 0x7e)
+                break;
+        }
+        escape[length] = '\0';
+
+        /* Inputs end with a reset. */
+        if (!strcmp(escape, RESET_ESCAPE)) {
+            current[0] = '\0';
+            continue;
+        }
+
+        escapes++;
+        if (!strcmp(escape, current)) {
+            fprintf(stderr, "queercat %s: escape \"\\033%s\" repeats the color already set\n",
+                    escape_case->options, escape + 1);
+            repeated = true;
+        }
+        strcpy(current, escape);
+    }
+
+    int status = pclose(output);
+    if (status != 0) {
+        fprintf(stderr, "queercat %s: exited with status %d\n", escape_case->options, status);
+        return false;
+    }
+
+    if (escapes != escape_case->escapes) {
+        fprintf(stderr, "queercat %s: %zu color escapes, expected %zu\n",
+                escape_case->options, escapes, escape_case->escapes);
+        return false;
+    }
+
+    return !repeated;
+}
+
+int main(int argc, char** argv)
+{
+    int failures = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: queercat-test-escapes path/to/queercat path/to/escapes.txt\n");
+        return 1;
+    }
+
+    for (int i = 0; i < CASE_COUNT; i++) {
+        if (!check_case(argv[1], argv[2], &cases[i]))
+            failures++;
+    }
+
+    printf("%d cases, %d failures\n", CASE_COUNT, failures);
+    return failures ? 1 : 0;
+}
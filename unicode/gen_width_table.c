@@ -0,0 +1,126 @@
+/* *** Includes ******************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* *** Constants *****************************************************/
+#define CHAR_COUNT (0x110000)
+#define BLOCK_BITS (8)
+#define BLOCK_SIZE (1 << BLOCK_BITS)
+#define BLOCK_COUNT (CHAR_COUNT / BLOCK_SIZE)
+#define WIDTHS_PER_BYTE (4)
+#define BLOCK_BYTES (BLOCK_SIZE / WIDTHS_PER_BYTE)
+#define MAX_UNIQUE_BLOCKS (256)
+#define DEFAULT_WIDTH (1)
+
+
+/* *** Types *********************************************************/
+/* One block of widths, two bits per character. */
+typedef struct block_s {
+    uint8_t bytes[BLOCK_BYTES];
+} block_t;
+
+
+/* *** Functions *****************************************************/
+static void read_widths(const char *path, uint8_t *widths)
+{
+    char line[256];
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    memset(widths, DEFAULT_WIDTH, CHAR_COUNT);
+
+    for (int line_number = 1; fgets(line, sizeof(line), f) != NULL; line_number++) {
+        unsigned int first, last, width;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%X..%X;%u", &first, &last, &width) != 3 || first > last || last >= CHAR_COUNT || width > 2) {
+            fprintf(stderr, "%s:%d: Invalid line\n", path, line_number);
+            exit(1);
+        }
+
+        memset(widths + first, width, last - first + 1);
+    }
+
+    fclose(f);
+}
+
+/* Splits the widths into blocks, sharing the blocks that are alike. */
+static int build_stages(const uint8_t *widths, uint8_t *stage1, block_t *stage2)
+{
+    int unique_blocks = 0;
+
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        block_t block = { { 0 } };
+        int j;
+
+        for (int c = 0; c < BLOCK_SIZE; c++)
+            block.bytes[c / WIDTHS_PER_BYTE] |= widths[i * BLOCK_SIZE + c] << (2 * (c % WIDTHS_PER_BYTE));
+
+        for (j = 0; j < unique_blocks; j++) {
+            if (!memcmp(&stage2[j], &block, sizeof(block)))
+                break;
+        }
+
+        if (j == unique_blocks) {
+            if (unique_blocks == MAX_UNIQUE_BLOCKS) {
+                fprintf(stderr, "Too many distinct blocks\n");
+                exit(1);
+            }
+            stage2[unique_blocks++] = block;
+        }
+
+        stage1[i] = j;
+    }
+
+    return unique_blocks;
+}
+
+static void print_table(const char *path, const uint8_t *stage1, const block_t *stage2, int unique_blocks)
+{
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    printf("/* Generated by gen_width_table from %s. Do not edit. */\n", name);
+    printf("#define WIDTH_TABLE_CHARS (0x%x)\n", CHAR_COUNT);
+    printf("#define WIDTH_TABLE_BLOCK_BITS (%d)\n\n", BLOCK_BITS);
+
+    printf("static const uint8_t width_stage1[%d] = {", BLOCK_COUNT);
+    for (int i = 0; i < BLOCK_COUNT; i++)
+        printf("%s%d,", (i % 16) ? " " : "\n    ", stage1[i]);
+    printf("\n};\n\n");
+
+    printf("static const uint8_t width_stage2[%d][%d] = {\n", unique_blocks, BLOCK_BYTES);
+    for (int i = 0; i < unique_blocks; i++) {
+        printf("    {");
+        for (int j = 0; j < BLOCK_BYTES; j++)
+            printf("%s0x%02x,", (j % 16) ? " " : "\n        ", stage2[i].bytes[j]);
+        printf("\n    },\n");
+    }
+    printf("};\n");
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t widths[CHAR_COUNT];
+    static uint8_t stage1[BLOCK_COUNT];
+    static block_t stage2[MAX_UNIQUE_BLOCKS];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: gen_width_table width.txt > width_table.h\n");
+        return 1;
+    }
+
+    read_widths(argv[1], widths);
+    int unique_blocks = build_stages(widths, stage1, stage2);
+    print_table(argv[1], stage1, stage2, unique_blocks);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Writes width.txt, the column widths queercat uses, from the Unicode database
+bundled with Python. Run it again to move to a newer Unicode version.
+
+Usage: python3 snapshot_widths.py > width.txt
+"""
+
+import sys
+import unicodedata
+
+MAX_CHAR = 0x10ffff
+
+# Prepended_Concatenation_Mark, which Python does not provide.
+PREPENDED_MARKS = (0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605, 0x06dd, 0x070f, 0x0890, 0x0891, 0x08e2, 0x110bd, 0x110cd)
+
+# Blocks and planes reserved for CJK ideographs.
+IDEOGRAPH_RANGES = (
+    (0x3400, 0x4dbf),
+    (0x4e00, 0x9fff),
+    (0xf900, 0xfaff),
+    (0x20000, 0x2fffd),
+    (0x30000, 0x3fffd),
+)
+
+
+def width(c):
+    category = unicodedata.category(chr(c))
+
+    # Controls, combining marks and invisible formatting characters take no
+    # column. The soft hyphen and the prepended concatenation marks are
+    # formatting characters that are shown.
+    if category in ('Cc', 'Mn', 'Me') or (category == 'Cf' and c != 0x00ad and c not in PREPENDED_MARKS):
+        return 0
+
+    # Hangul vowels and final consonants join the syllable before them.
+    if 0x1160 <= c <= 0x11ff or 0xd7b0 <= c <= 0xd7ff:
+        return 0
+
+    # Unassigned characters are wide where ideographs are going to be, and
+    # narrow elsewhere. Python reports them as fullwidth, so they are handled
+    # before asking it.
+    if category == 'Cn':
+        return 2 if any(first <= c <= last for first, last in IDEOGRAPH_RANGES) else 1
+
+    if unicodedata.east_asian_width(chr(c)) in ('W', 'F'):
+        return 2
+
+    return 1
+
+
+def main():
+    print('# Column widths of Unicode characters, for queercat.')
+    print('# Generated by snapshot_widths.py from Unicode %s.' % unicodedata.unidata_version)
+    print('# Format: first..last;width. Characters not listed are 1 column wide.')
+
+    start = 0
+    current = width(0)
+    for c in range(1, MAX_CHAR + 2):
+        w = width(c) if c <= MAX_CHAR else None
+        if w != current:
+            if current != 1:
+                print('%04X..%04X;%d' % (start, c - 1, current))
+            start = c
+            current = w
+
+
+if __name__ == '__main__':
+    sys.exit(main())